@@ -0,0 +1,467 @@
+#include "analyze.h"
+#include "atom.h"
+#include "eval.h"
+#include "env.h"
+#include "gc.h"
+#include "scope.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// A node evaluates itself in *env and returns the result. Instead of
+// evaluating a subexpression whose value is its own value (a branch of
+// if, the body of a called closure) it may also store that expression in
+// *next, and the frame to run it in in *env, and return NULL. analyze_run
+// then carries on with it, so tail calls do not grow the C stack.
+
+typedef struct atom *(*node_fn)(struct node *node, struct env **env,
+    struct node **next);
+
+struct node
+{
+    node_fn run;
+
+    // The constant, quoted datum, symbol, error message or, for lambda,
+    // the parameters.
+    struct atom *value;
+
+    struct node **operands;
+    int operand_count;
+
+    // Where a local variable or a define inside a lambda lives.
+    int depth;
+    int slot;
+
+    // The inline cache of a global variable.
+    struct env_cache cache;
+
+    // The source of a lambda, and the layout of the frames of its calls.
+    struct atom *body;
+    struct atom **slots;
+    int slot_count;
+    int param_count;
+};
+
+static struct node *node_new(node_fn run, struct atom *value,
+    int operand_count)
+{
+    struct node *node = gc_alloc(sizeof(*node), GC_NODE);
+
+    node->run = run;
+    node->value = value;
+
+    if (operand_count)
+    {
+        node->operands = gc_alloc(operand_count * sizeof(*node->operands),
+            GC_DATA);
+        node->operand_count = operand_count;
+    }
+
+    return node;
+}
+
+static struct atom *run_const(struct node *node, struct env **env,
+    struct node **next)
+{
+    (void) env;
+    (void) next;
+
+    return node->value;
+}
+
+static struct atom *run_error(struct node *node, struct env **env,
+    struct node **next)
+{
+    (void) env;
+    (void) next;
+
+    printf("error: %s\n", node->value->str.str);
+
+    return &nil_atom;
+}
+
+static struct atom *lookup(struct env *env, struct atom *symbol)
+{
+    struct atom *value = env_lookup_sym(env, symbol);
+
+    if (!value)
+    {
+        printf("error: undefined variable: %s\n", symbol->str.str);
+        return &nil_atom;
+    }
+
+    return value;
+}
+
+static struct atom *run_local(struct node *node, struct env **env,
+    struct node **next)
+{
+    struct env *scope = *env;
+    struct atom *value;
+    int depth = node->depth;
+
+    (void) next;
+
+    while (depth--)
+        scope = env_parent(scope);
+
+    value = *env_slot(scope, node->slot);
+
+    // A define in the body has not bound the slot yet.
+    if (!value)
+        value = lookup(env_parent(scope), node->value);
+
+    return value;
+}
+
+// Globals are looked up from the top-level environment, node->depth
+// frames up. The cache is checked after walking there, as the frames in
+// between differ from call to call.
+
+static struct atom *run_global(struct node *node, struct env **env,
+    struct node **next)
+{
+    struct env *scope = *env;
+    struct atom *value;
+    int depth = node->depth;
+
+    (void) next;
+
+    while (depth--)
+        scope = env_parent(scope);
+
+    value = env_lookup_cached(scope, node->value, &node->cache);
+
+    if (!value)
+    {
+        printf("error: undefined variable: %s\n", node->value->str.str);
+        return &nil_atom;
+    }
+
+    return value;
+}
+
+static struct atom *run_if(struct node *node, struct env **env,
+    struct node **next)
+{
+    struct atom *predicate = analyze_run(node->operands[0], *env);
+
+    *next = node->operands[IS_TRUE(predicate) ? 1 : 2];
+
+    return NULL;
+}
+
+static struct atom *run_define(struct node *node, struct env **env,
+    struct node **next)
+{
+    struct atom *value = analyze_run(node->operands[0], *env);
+
+    (void) next;
+
+    if (!env_set_sym(*env, node->value, value))
+    {
+        printf("error: cannot redefine %s\n", node->value->str.str);
+        return &nil_atom;
+    }
+
+    return value;
+}
+
+static struct atom *run_define_local(struct node *node, struct env **env,
+    struct node **next)
+{
+    struct atom *value = analyze_run(node->operands[0], *env);
+
+    (void) next;
+
+    if (!env_define_slot(*env, node->slot, value))
+    {
+        printf("error: cannot redefine %s\n", node->value->str.str);
+        return &nil_atom;
+    }
+
+    return value;
+}
+
+static struct atom *run_lambda(struct node *node, struct env **env,
+    struct node **next)
+{
+    struct atom *closure = atom_new_closure(node->value, node->body, *env);
+
+    (void) next;
+
+    closure->closure.node = node;
+
+    return closure;
+}
+
+static void run_args(struct node *node, struct env *env,
+    struct atom **args)
+{
+    int i;
+
+    for (i = 1; i < node->operand_count; ++i)
+        args[i - 1] = analyze_run(node->operands[i], env);
+}
+
+// The arity of the function is checked before any argument is evaluated.
+
+static struct atom *run_call(struct node *node, struct env **env,
+    struct node **next)
+{
+    struct atom *fn = analyze_run(node->operands[0], *env);
+    int argc = node->operand_count - 1;
+    struct atom *args[argc + 1];
+    struct node *lambda;
+
+    if (IS_PRIMITIVE(fn))
+    {
+        if (!eval_check_arity(fn->primitive, argc))
+            return &nil_atom;
+
+        run_args(node, *env, args);
+
+        return fn->primitive->fn(args, argc);
+    }
+
+    if (!IS_CLOSURE(fn))
+    {
+        printf("error: cannot evaluate\n");
+        return &nil_atom;
+    }
+
+    if (!fn->closure.node)
+    {
+        fn->closure.node = analyze_lambda(fn->closure.params,
+            fn->closure.body);
+    }
+
+    lambda = fn->closure.node;
+
+    if (argc != lambda->param_count)
+    {
+        printf("error: incorrect number of arguments\n");
+        return &nil_atom;
+    }
+
+    run_args(node, *env, args);
+
+    *env = env_extend_slots(fn->closure.env, lambda->slots,
+        lambda->slot_count, args, argc);
+    *next = lambda->operands[0];
+
+    return NULL;
+}
+
+static struct node *analyze_expr(struct scope *scope, struct atom *expr);
+
+static struct node *analyze_error(const char *message)
+{
+    return node_new(&run_error, atom_new_str(message, strlen(message)), 0);
+}
+
+static struct node *analyze_symbol(struct scope *scope, struct atom *symbol)
+{
+    int depth;
+    int slot = scope_resolve(scope, symbol, &depth);
+    struct node *node;
+
+    node = node_new(slot >= 0 ? &run_local : &run_global, symbol, 0);
+    node->depth = depth;
+    node->slot = slot;
+
+    return node;
+}
+
+static struct node *analyze_quote(struct pair *op)
+{
+    if (!CDR(op))
+        return analyze_error("quote takes 1 argument");
+
+    return node_new(&run_const, CAR(CDR(op)), 0);
+}
+
+static struct node *analyze_if(struct scope *scope, struct pair *op)
+{
+    struct pair *predicate = CDR(op);
+    struct pair *true_case = CDR(predicate);
+    struct pair *false_case = CDR(true_case);
+    struct node *node;
+
+    if (!predicate || !true_case || !false_case)
+        return analyze_error("if takes 3 arguments");
+
+    node = node_new(&run_if, NULL, 3);
+    node->operands[0] = analyze_expr(scope, CAR(predicate));
+    node->operands[1] = analyze_expr(scope, CAR(true_case));
+    node->operands[2] = analyze_expr(scope, CAR(false_case));
+
+    return node;
+}
+
+static struct node *analyze_define(struct scope *scope, struct pair *op)
+{
+    struct pair *value = CDDR(op);
+    struct atom *name;
+    struct node *node;
+
+    if (!value)
+        return analyze_error("define takes two arguments");
+
+    name = CAR(CDR(op));
+
+    if (!IS_SYM(name))
+        return analyze_error("define: first arg must be symbol");
+
+    // Inside a lambda the name has a slot in the current frame.
+    node = node_new(scope ? &run_define_local : &run_define, name, 1);
+
+    if (scope)
+        node->slot = scope_slot(scope, name);
+
+    node->operands[0] = analyze_expr(scope, CAR(value));
+
+    return node;
+}
+
+static struct node *analyze_function(struct scope *parent,
+    struct atom *params, struct atom *body)
+{
+    struct node *node = node_new(&run_lambda, params, 1);
+    struct scope scope;
+
+    scope_init(&scope, parent, params, body);
+
+    node->body = body;
+    node->param_count = atom_list_length(params);
+    node->slots = scope_copy_slots(&scope);
+    node->slot_count = scope.slot_count;
+    node->operands[0] = analyze_expr(&scope, body);
+
+    scope_release(&scope);
+
+    return node;
+}
+
+static struct node *analyze_call(struct scope *scope, struct atom *expr)
+{
+    struct node *node = node_new(&run_call, NULL,
+        atom_list_length(expr));
+    struct pair *elem;
+    int i = 0;
+
+    for (elem = expr->list.first; elem; elem = elem->cdr)
+        node->operands[i++] = analyze_expr(scope, elem->car);
+
+    return node;
+}
+
+static struct node *analyze_expr(struct scope *scope, struct atom *expr)
+{
+    struct pair *op;
+
+    if (IS_SYM(expr))
+        return analyze_symbol(scope, expr);
+
+    if (!IS_LIST(expr))
+        return node_new(&run_const, expr, 0);
+
+    op = expr->list.first;
+
+    if (IS_SYM(CAR(op)) && SYMBOL(CAR(op))->special)
+    {
+        special_form_t special = SYMBOL(CAR(op))->special;
+
+        if (special == &builtin_quote)
+            return analyze_quote(op);
+
+        if (special == &builtin_if)
+            return analyze_if(scope, op);
+
+        if (special == &builtin_define)
+            return analyze_define(scope, op);
+
+        if (special == &builtin_lambda)
+        {
+            const char *error = lambda_syntax_error(op);
+
+            if (error)
+                return analyze_error(error);
+
+            return analyze_function(scope, CAR(CDR(op)), CAR(CDDR(op)));
+        }
+
+        return analyze_error("unsupported special form");
+    }
+
+    return analyze_call(scope, expr);
+}
+
+struct node *analyze(struct atom *expr)
+{
+    return analyze_expr(NULL, expr);
+}
+
+// Analyzes a lambda on its own, as is needed for closures created by the
+// other evaluators. Only its own frame is known; everything else is
+// looked up by name from the closure environment.
+
+struct node *analyze_lambda(struct atom *params, struct atom *body)
+{
+    return analyze_function(NULL, params, body);
+}
+
+struct atom *analyze_run(struct node *node, struct env *env)
+{
+    struct atom *result;
+
+    while (!(result = node->run(node, &env, &node)))
+        ;
+
+    return result;
+}
+
+struct atom *analyze_eval(struct atom *expr, struct env *env)
+{
+    return analyze_run(analyze(expr), env);
+}
+
+void node_gc_trace(struct node *node)
+{
+    int i;
+
+    gc_mark(node->value);
+    gc_mark(node->operands);
+    gc_mark(node->body);
+    gc_mark(node->slots);
+    gc_mark(node->cache.env);
+    gc_mark(node->cache.value);
+
+    for (i = 0; i < node->operand_count; ++i)
+        gc_mark(node->operands[i]);
+
+    for (i = 0; i < node->slot_count; ++i)
+        gc_mark(node->slots[i]);
+}
+
+#ifdef BUILD_TEST
+
+#include "test_util.h"
+#include "parse.h"
+
+TEST(analyzed_expression_runs_in_any_env)
+{
+    int pos = 0;
+    struct node *node = analyze(parse("((lambda (x) (* x y)) 6)", &pos));
+    struct env *env1 = env_new();
+    struct env *env2 = env_new();
+
+    env_set(env1, "y", atom_new_int(7));
+    env_set(env2, "y", atom_new_int(2));
+
+    ASSERT_EQ(42, INT_VAL(analyze_run(node, env1)));
+    ASSERT_EQ(12, INT_VAL(analyze_run(node, env2)));
+    ASSERT_EQ(42, INT_VAL(analyze_run(node, env1)));
+}
+
+#endif /* BUILD_TEST */
@@ -0,0 +1,19 @@
+#ifndef ANALYZE_H
+#define ANALYZE_H
+
+struct atom;
+struct env;
+struct node;
+
+// Converts an expression once into a tree of nodes, each holding the
+// function that evaluates it and its already analyzed operands, so that
+// running it again does not need to look at the source.
+struct node *analyze(struct atom *expr);
+struct node *analyze_lambda(struct atom *params, struct atom *body);
+
+struct atom *analyze_run(struct node *node, struct env *env);
+struct atom *analyze_eval(struct atom *expr, struct env *env);
+
+void node_gc_trace(struct node *node);
+
+#endif
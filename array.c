@@ -0,0 +1,656 @@
+#include "array.h"
+#include "atom.h"
+#include "gc.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// The kernels below are written once with GCC vector extensions, four
+// elements at a time, followed by a scalar loop for the remainder. On
+// x86-64 each kernel is built both for AVX2 and for the baseline (SSE2),
+// and the dynamic loader picks the variant the CPU supports. Elsewhere
+// the compiler lowers the vectors to whatever the target has.
+//
+// Integer arithmetic wraps around, so it is done on unsigned values.
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define KERNEL
+#endif
+
+#define LANES 4
+
+typedef int64_t i64x4
+    __attribute__((vector_size(32), aligned(8), __may_alias__));
+typedef uint64_t u64x4
+    __attribute__((vector_size(32), aligned(8), __may_alias__));
+typedef double f64x4
+    __attribute__((vector_size(32), aligned(8), __may_alias__));
+
+#define ELEMENTWISE(NAME, TYPE, ELEM, VEC, OP) \
+    KERNEL static void NAME(TYPE *r, const TYPE *a, const TYPE *b, int n) \
+    { \
+        int i = 0; \
+        \
+        for (; i + LANES <= n; i += LANES) \
+            *(VEC *)(r + i) = *(const VEC *)(a + i) OP *(const VEC *)(b + i); \
+        \
+        for (; i < n; ++i) \
+            r[i] = (ELEM)a[i] OP (ELEM)b[i]; \
+    }
+
+ELEMENTWISE(add_i64, int64_t, uint64_t, u64x4, +)
+ELEMENTWISE(sub_i64, int64_t, uint64_t, u64x4, -)
+ELEMENTWISE(mul_i64, int64_t, uint64_t, u64x4, *)
+ELEMENTWISE(add_f64, double, double, f64x4, +)
+ELEMENTWISE(sub_f64, double, double, f64x4, -)
+ELEMENTWISE(mul_f64, double, double, f64x4, *)
+ELEMENTWISE(div_f64, double, double, f64x4, /)
+
+// Vector comparisons give -1 for true, so negate them to get 1.
+
+#define GREATER(NAME, TYPE, VEC) \
+    KERNEL static void NAME(int64_t *r, const TYPE *a, const TYPE *b, int n) \
+    { \
+        int i = 0; \
+        \
+        for (; i + LANES <= n; i += LANES) \
+            *(i64x4 *)(r + i) = -(*(const VEC *)(a + i) > *(const VEC *)(b + i)); \
+        \
+        for (; i < n; ++i) \
+            r[i] = a[i] > b[i]; \
+    }
+
+GREATER(gt_i64, int64_t, i64x4)
+GREATER(gt_f64, double, f64x4)
+
+// Division by zero has to be reported rather than trap, and there is no
+// vector instruction for integer division anyway.
+
+static int div_i64(int64_t *r, const int64_t *a, const int64_t *b, int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i)
+    {
+        if (!b[i])
+            return 0;
+    }
+
+    for (i = 0; i < n; ++i)
+        r[i] = b[i] == -1 ? (int64_t)-(uint64_t)a[i] : a[i] / b[i];
+
+    return 1;
+}
+
+#define SUM(NAME, TYPE, ELEM, VEC) \
+    KERNEL static TYPE NAME(const TYPE *a, const TYPE *b, int n) \
+    { \
+        VEC acc = { 0 }; \
+        ELEM sum; \
+        int i = 0; \
+        \
+        for (; i + LANES <= n; i += LANES) \
+        { \
+            if (b) \
+                acc += *(const VEC *)(a + i) * *(const VEC *)(b + i); \
+            else \
+                acc += *(const VEC *)(a + i); \
+        } \
+        \
+        sum = acc[0] + acc[1] + acc[2] + acc[3]; \
+        \
+        for (; i < n; ++i) \
+            sum += b ? (ELEM)a[i] * (ELEM)b[i] : (ELEM)a[i]; \
+        \
+        return sum; \
+    }
+
+// Sums a, or the products of a and b (the dot product) if b is not NULL.
+SUM(sum_i64, int64_t, uint64_t, u64x4)
+SUM(sum_f64, double, double, f64x4)
+
+// Keeps the smallest (CMP <) or largest (CMP >) element in each lane by
+// masking, as there is no vector ?: in C. n must not be zero.
+
+#define EXTREME(NAME, TYPE, VEC, CMP) \
+    KERNEL static TYPE NAME(const TYPE *a, int n) \
+    { \
+        TYPE result = a[0]; \
+        int i = 0, j; \
+        \
+        if (n >= LANES) \
+        { \
+            VEC acc = *(const VEC *)a; \
+            \
+            for (i = LANES; i + LANES <= n; i += LANES) \
+            { \
+                VEC v = *(const VEC *)(a + i); \
+                i64x4 take = v CMP acc; \
+                acc = (VEC)(((i64x4)v & take) | ((i64x4)acc & ~take)); \
+            } \
+            \
+            for (j = 0; j < LANES; ++j) \
+            { \
+                if (acc[j] CMP result) \
+                    result = acc[j]; \
+            } \
+        } \
+        \
+        for (; i < n; ++i) \
+        { \
+            if (a[i] CMP result) \
+                result = a[i]; \
+        } \
+        \
+        return result; \
+    }
+
+EXTREME(min_i64, int64_t, i64x4, <)
+EXTREME(max_i64, int64_t, i64x4, >)
+EXTREME(min_f64, double, f64x4, <)
+EXTREME(max_f64, double, f64x4, >)
+
+KERNEL static void scale_i64(int64_t *r, const int64_t *a, int64_t k, int n)
+{
+    int i = 0;
+
+    for (; i + LANES <= n; i += LANES)
+        *(u64x4 *)(r + i) = *(const u64x4 *)(a + i) * (uint64_t)k;
+
+    for (; i < n; ++i)
+        r[i] = (uint64_t)a[i] * (uint64_t)k;
+}
+
+KERNEL static void scale_f64(double *r, const double *a, double k, int n)
+{
+    int i = 0;
+
+    for (; i + LANES <= n; i += LANES)
+        *(f64x4 *)(r + i) = *(const f64x4 *)(a + i) * k;
+
+    for (; i < n; ++i)
+        r[i] = a[i] * k;
+}
+
+static int is_number(struct atom *atom)
+{
+    return IS_INT(atom) || IS_FLOAT(atom);
+}
+
+static double number_val(struct atom *atom)
+{
+    return IS_FLOAT(atom) ? FLOAT_VAL(atom) : (double)INT_VAL(atom);
+}
+
+static const char *elem_name(int elem)
+{
+    return elem == ARRAY_I64 ? "i64" : "f64";
+}
+
+static int check_array(const char *name, struct atom *atom)
+{
+    if (IS_ARRAY(atom))
+        return 1;
+
+    printf("error: %s: not an array\n", name);
+    return 0;
+}
+
+struct atom *array_new(int elem, int len)
+{
+    struct atom *atom = atom_new(ATOM_ARRAY);
+
+    atom->array.elem = elem;
+    atom->array.len = len;
+
+    if (len)
+        atom->array.data = gc_alloc(ARRAY_SIZE(atom), GC_DATA);
+
+    return atom;
+}
+
+// Stores value as element i, if it can be represented exactly.
+
+static int array_store(struct atom *array, int i, struct atom *value)
+{
+    if (array->array.elem == ARRAY_I64)
+    {
+        if (!IS_INT(value))
+            return 0;
+
+        ARRAY_I64_DATA(array)[i] = INT_VAL(value);
+    }
+    else
+    {
+        if (!is_number(value))
+            return 0;
+
+        ARRAY_F64_DATA(array)[i] = number_val(value);
+    }
+
+    return 1;
+}
+
+static struct atom *array_load(struct atom *array, int i)
+{
+    if (array->array.elem == ARRAY_I64)
+        return atom_new_int(ARRAY_I64_DATA(array)[i]);
+
+    return atom_new_float(ARRAY_F64_DATA(array)[i]);
+}
+
+struct atom *array_make(int elem, struct atom *len, struct atom *fill)
+{
+    struct atom *array;
+    int i;
+
+    if (!IS_INT(len) || INT_VAL(len) < 0 || INT_VAL(len) > INT_MAX)
+    {
+        printf("error: make-%s-array: invalid length\n", elem_name(elem));
+        return &nil_atom;
+    }
+
+    array = array_new(elem, INT_VAL(len));
+
+    if (!fill)
+        return array;
+
+    for (i = 0; i < array->array.len; ++i)
+    {
+        if (!array_store(array, i, fill))
+        {
+            printf("error: make-%s-array: invalid fill value\n",
+                elem_name(elem));
+            return &nil_atom;
+        }
+    }
+
+    return array;
+}
+
+struct atom *array_from_list(int elem, struct atom *list)
+{
+    struct atom *array;
+    struct pair *item;
+    int i = 0;
+
+    if (!IS_LIST(list) && !IS_NIL(list))
+    {
+        printf("error: list->%s-array: not a list\n", elem_name(elem));
+        return &nil_atom;
+    }
+
+    array = array_new(elem, atom_list_length(list));
+
+    for (item = list->list.first; item; item = item->cdr)
+    {
+        if (!array_store(array, i++, item->car))
+        {
+            printf("error: list->%s-array: invalid element\n",
+                elem_name(elem));
+            return &nil_atom;
+        }
+    }
+
+    return array;
+}
+
+struct atom *array_to_list(struct atom *array)
+{
+    struct atom *list;
+    int i;
+
+    if (!check_array("array->list", array))
+        return &nil_atom;
+
+    if (!array->array.len)
+        return &nil_atom;
+
+    list = atom_new_list_empty();
+
+    for (i = 0; i < array->array.len; ++i)
+        atom_list_push(list, array_load(array, i));
+
+    return list;
+}
+
+static int check_index(const char *name, struct atom *array,
+    struct atom *index)
+{
+    if (!check_array(name, array))
+        return 0;
+
+    if (!IS_INT(index) || INT_VAL(index) < 0 ||
+        INT_VAL(index) >= array->array.len)
+    {
+        printf("error: %s: index out of range\n", name);
+        return 0;
+    }
+
+    return 1;
+}
+
+struct atom *array_ref(struct atom *array, struct atom *index)
+{
+    if (!check_index("array-ref", array, index))
+        return &nil_atom;
+
+    return array_load(array, INT_VAL(index));
+}
+
+struct atom *array_set(struct atom *array, struct atom *index,
+    struct atom *value)
+{
+    if (!check_index("array-set!", array, index))
+        return &nil_atom;
+
+    if (!array_store(array, INT_VAL(index), value))
+    {
+        printf("error: array-set!: invalid value for %s array\n",
+            elem_name(array->array.elem));
+        return &nil_atom;
+    }
+
+    return value;
+}
+
+// Returns the elements of operand as len values of type elem, converting
+// an i64 array or repeating a number as needed.
+
+static const void *operand_data(struct atom *operand, int elem, int len)
+{
+    void *data;
+    int i;
+
+    if (IS_ARRAY(operand) && operand->array.elem == elem)
+        return operand->array.data;
+
+    if (!len)
+        return NULL;
+
+    data = gc_alloc((size_t)len * 8, GC_DATA);
+
+    for (i = 0; i < len; ++i)
+    {
+        if (elem == ARRAY_I64)
+            ((int64_t *)data)[i] = INT_VAL(operand);
+        else if (IS_ARRAY(operand))
+            ((double *)data)[i] = ARRAY_I64_DATA(operand)[i];
+        else
+            ((double *)data)[i] = number_val(operand);
+    }
+
+    return data;
+}
+
+struct atom *array_arith(char op, struct atom *a, struct atom *b)
+{
+    struct atom *operands[] = { a, b };
+    const void *x, *y;
+    struct atom *result;
+    int elem = ARRAY_I64;
+    int len = -1;
+    int i;
+
+    for (i = 0; i < 2; ++i)
+    {
+        struct atom *operand = operands[i];
+
+        if (IS_ARRAY(operand))
+        {
+            if (len >= 0 && operand->array.len != len)
+            {
+                printf("error: %c: arrays differ in length\n", op);
+                return &nil_atom;
+            }
+
+            len = operand->array.len;
+
+            if (operand->array.elem == ARRAY_F64)
+                elem = ARRAY_F64;
+        }
+        else if (IS_FLOAT(operand))
+        {
+            elem = ARRAY_F64;
+        }
+        else if (!IS_INT(operand))
+        {
+            printf("error: %c: operands must be numbers or arrays\n", op);
+            return &nil_atom;
+        }
+    }
+
+    if (len < 0)
+    {
+        printf("error: %c: no array operand\n", op);
+        return &nil_atom;
+    }
+
+    x = operand_data(a, elem, len);
+    y = operand_data(b, elem, len);
+    result = array_new(op == '>' ? ARRAY_I64 : elem, len);
+
+    if (elem == ARRAY_I64)
+    {
+        int64_t *r = ARRAY_I64_DATA(result);
+
+        switch (op)
+        {
+        case '+': add_i64(r, x, y, len); break;
+        case '-': sub_i64(r, x, y, len); break;
+        case '*': mul_i64(r, x, y, len); break;
+        case '>': gt_i64(r, x, y, len); break;
+
+        case '/':
+            if (!div_i64(r, x, y, len))
+            {
+                printf("error: /: division by zero\n");
+                return &nil_atom;
+            }
+            break;
+        }
+    }
+    else if (op == '>')
+    {
+        gt_f64(ARRAY_I64_DATA(result), x, y, len);
+    }
+    else
+    {
+        double *r = ARRAY_F64_DATA(result);
+
+        switch (op)
+        {
+        case '+': add_f64(r, x, y, len); break;
+        case '-': sub_f64(r, x, y, len); break;
+        case '*': mul_f64(r, x, y, len); break;
+        case '/': div_f64(r, x, y, len); break;
+        }
+    }
+
+    return result;
+}
+
+struct atom *array_sum(struct atom *array)
+{
+    if (!check_array("sum", array))
+        return &nil_atom;
+
+    if (array->array.elem == ARRAY_I64)
+        return atom_new_int(sum_i64(array->array.data, NULL, array->array.len));
+
+    return atom_new_float(sum_f64(array->array.data, NULL, array->array.len));
+}
+
+static struct atom *array_extreme(const char *name, struct atom *array,
+    int max)
+{
+    if (!check_array(name, array))
+        return &nil_atom;
+
+    if (!array->array.len)
+    {
+        printf("error: %s: empty array\n", name);
+        return &nil_atom;
+    }
+
+    if (array->array.elem == ARRAY_I64)
+    {
+        const int64_t *data = array->array.data;
+
+        return atom_new_int(max ? max_i64(data, array->array.len) :
+            min_i64(data, array->array.len));
+    }
+    else
+    {
+        const double *data = array->array.data;
+
+        return atom_new_float(max ? max_f64(data, array->array.len) :
+            min_f64(data, array->array.len));
+    }
+}
+
+struct atom *array_min(struct atom *array)
+{
+    return array_extreme("min", array, 0);
+}
+
+struct atom *array_max(struct atom *array)
+{
+    return array_extreme("max", array, 1);
+}
+
+struct atom *array_dot(struct atom *a, struct atom *b)
+{
+    int elem;
+    int len;
+
+    if (!check_array("dot", a) || !check_array("dot", b))
+        return &nil_atom;
+
+    if (a->array.len != b->array.len)
+    {
+        printf("error: dot: arrays differ in length\n");
+        return &nil_atom;
+    }
+
+    len = a->array.len;
+    elem = a->array.elem == ARRAY_F64 || b->array.elem == ARRAY_F64 ?
+        ARRAY_F64 : ARRAY_I64;
+
+    if (elem == ARRAY_I64)
+        return atom_new_int(sum_i64(a->array.data, b->array.data, len));
+
+    return atom_new_float(sum_f64(operand_data(a, elem, len),
+        operand_data(b, elem, len), len));
+}
+
+struct atom *array_scale(struct atom *array, struct atom *factor)
+{
+    struct atom *result;
+    int len;
+
+    if (!check_array("scale", array))
+        return &nil_atom;
+
+    if (!is_number(factor))
+    {
+        printf("error: scale: factor must be a number\n");
+        return &nil_atom;
+    }
+
+    len = array->array.len;
+
+    if (array->array.elem == ARRAY_I64 && IS_INT(factor))
+    {
+        result = array_new(ARRAY_I64, len);
+        scale_i64(result->array.data, array->array.data, INT_VAL(factor),
+            len);
+    }
+    else
+    {
+        result = array_new(ARRAY_F64, len);
+        scale_f64(result->array.data, operand_data(array, ARRAY_F64, len),
+            number_val(factor), len);
+    }
+
+    return result;
+}
+
+#ifdef BUILD_TEST
+
+#include "test_util.h"
+
+TEST(array_kernels_handle_every_length)
+{
+    int len;
+
+    // Cover lengths below, at and past the vector width.
+    for (len = 0; len < 11; ++len)
+    {
+        struct atom *a = array_new(ARRAY_I64, len);
+        struct atom *b = array_new(ARRAY_F64, len);
+        struct atom *r;
+        long sum = 0, min = 2, max = -2;
+        int i;
+
+        for (i = 0; i < len; ++i)
+        {
+            long value = (i * 7) % 5 - 2;
+
+            ARRAY_I64_DATA(a)[i] = value;
+            ARRAY_F64_DATA(b)[i] = i + 0.5;
+            sum += value;
+            min = value < min ? value : min;
+            max = value > max ? value : max;
+        }
+
+        ASSERT_EQ(sum, INT_VAL(array_sum(a)));
+
+        r = array_arith('+', a, b);
+        ASSERT_EQ(ARRAY_F64, r->array.elem);
+
+        for (i = 0; i < len; ++i)
+        {
+            ASSERT_TRUE(ARRAY_F64_DATA(r)[i] ==
+                ARRAY_I64_DATA(a)[i] + ARRAY_F64_DATA(b)[i]);
+        }
+
+        r = array_arith('>', a, atom_new_int(0));
+
+        for (i = 0; i < len; ++i)
+            ASSERT_EQ(ARRAY_I64_DATA(a)[i] > 0, ARRAY_I64_DATA(r)[i]);
+
+        if (len)
+        {
+            struct atom *extreme = array_min(a);
+            ASSERT_EQ(min, INT_VAL(extreme));
+            extreme = array_max(a);
+            ASSERT_EQ(max, INT_VAL(extreme));
+            extreme = array_max(b);
+            ASSERT_TRUE(FLOAT_VAL(extreme) == len - 0.5);
+            extreme = array_min(b);
+            ASSERT_TRUE(FLOAT_VAL(extreme) == 0.5);
+        }
+    }
+}
+
+TEST(array_integer_arithmetic_wraps)
+{
+    struct atom *a = array_new(ARRAY_I64, 5);
+    struct atom *r;
+    int i;
+
+    for (i = 0; i < 5; ++i)
+        ARRAY_I64_DATA(a)[i] = INT64_MAX;
+
+    r = array_arith('+', a, atom_new_int(1));
+
+    for (i = 0; i < 5; ++i)
+        ASSERT_TRUE(ARRAY_I64_DATA(r)[i] == INT64_MIN);
+
+    ASSERT_TRUE(IS_NIL(array_arith('/', a, atom_new_int(0))));
+}
+
+#endif /* BUILD_TEST */
@@ -0,0 +1,36 @@
+#ifndef ARRAY_H
+#define ARRAY_H
+
+#include "atom.h"
+
+// Numeric arrays hold unboxed 64-bit integers (ARRAY_I64) or doubles
+// (ARRAY_F64) in one contiguous block, so that bulk operations run over
+// plain C arrays instead of atoms.
+//
+// The functions taking atoms check their arguments: on an error they
+// print a message naming the builtin and return nil.
+
+#define ARRAY_I64_DATA(ATOM) ((int64_t *)(ATOM)->array.data)
+#define ARRAY_F64_DATA(ATOM) ((double *)(ATOM)->array.data)
+
+struct atom *array_new(int elem, int len);
+struct atom *array_make(int elem, struct atom *len, struct atom *fill);
+struct atom *array_from_list(int elem, struct atom *list);
+struct atom *array_to_list(struct atom *array);
+
+struct atom *array_ref(struct atom *array, struct atom *index);
+struct atom *array_set(struct atom *array, struct atom *index,
+    struct atom *value);
+
+// Elementwise +, -, *, / and >. Either operand may be a number, which is
+// used for every element. The result is an f64 array if any operand is a
+// double; > gives an i64 array of ones and zeroes.
+struct atom *array_arith(char op, struct atom *a, struct atom *b);
+
+struct atom *array_sum(struct atom *array);
+struct atom *array_min(struct atom *array);
+struct atom *array_max(struct atom *array);
+struct atom *array_dot(struct atom *a, struct atom *b);
+struct atom *array_scale(struct atom *array, struct atom *factor);
+
+#endif
@@ -1,5 +1,7 @@
 #include "atom.h"
 #include "env.h"
+#include "gc.h"
+#include "bignum.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -13,9 +15,6 @@ struct atom nil_atom;
 __attribute__((constructor))
 static void setup_builtin_atoms()
 {
-    nil_atom.list = calloc(1, sizeof(*nil_atom.list));
-    LIST_INIT(nil_atom.list);
-
     true_atom.type = ATOM_TRUE;
     false_atom.type = ATOM_FALSE;
     nil_atom.type = ATOM_NIL;
@@ -23,45 +22,284 @@ static void setup_builtin_atoms()
 
 struct atom *atom_new(char type)
 {
-    struct atom *atom = calloc(1, sizeof(*atom));
+    struct atom *atom = gc_alloc(sizeof(*atom), GC_ATOM);
     atom->type = type;
     return atom;
 }
 
 struct atom *atom_new_int(long l)
 {
-    struct atom *atom = atom_new(ATOM_INT);
+    struct atom *atom;
+
+    if (l >= FIXNUM_MIN && l <= FIXNUM_MAX)
+        return FIXNUM(l);
+
+    atom = atom_new(ATOM_INT);
     atom->l = l;
     return atom;
 }
 
+// Returns a heap allocated copy of an immediate value.
+
+struct atom *atom_box(struct atom *atom)
+{
+    struct atom *box;
+
+    if (!IS_IMMEDIATE(atom))
+        return atom;
+
+    if (IS_FLONUM(atom))
+    {
+        box = atom_new(ATOM_FLOAT);
+        box->d = flonum_val(atom);
+        return box;
+    }
+
+    box = atom_new(ATOM_INT);
+    box->l = FIXNUM_VAL(atom);
+    return box;
+}
+
+struct atom *atom_new_float(double d)
+{
+    struct atom *atom;
+
+#if UINTPTR_MAX > 0xffffffffu
+    uint64_t bits;
+    int top;
+
+    memcpy(&bits, &d, sizeof(bits));
+    top = (bits >> 60) & 7;
+
+    // The exponent starts with 011 or 100 (the bit after the sign is
+    // implied by the one after it). 0.0 gets an encoding of its own, and
+    // the double that would collide with it is boxed.
+    if ((top == 3 || top == 4) && bits != 0x3000000000000000u)
+    {
+        bits = bits << 3 | bits >> 61;
+        return (struct atom *)(uintptr_t)((bits & ~(uint64_t)3) | 2);
+    }
+
+    if (!bits)
+        return (struct atom *)FLONUM_ZERO;
+#endif
+
+    atom = atom_new(ATOM_FLOAT);
+    atom->d = d;
+    return atom;
+}
+
 struct atom *atom_new_str(const char *str, int len)
 {
     struct atom *atom = atom_new(ATOM_STR);
-    atom->str.str = strndup(str, len);
+    atom->str.str = gc_strndup(str, len);
     atom->str.len = len;
     return atom;
 }
 
+// Every distinct symbol name is stored exactly once, as a struct symbol.
+// Symbol atoms all point at the name inside that canonical copy, so two
+// symbols are equal exactly when their str.str pointers are (see SYM_EQ).
+// The table does not keep symbols alive: the collector drops entries for
+// unreachable ones before it sweeps.
+
+static struct
+{
+    struct symbol **slots;
+    int size;
+    int count;
+} symbols;
+
+static unsigned int symbol_hash(const char *sym, int len)
+{
+    unsigned int hash = 2166136261u;
+
+    while (len--)
+    {
+        hash ^= (unsigned char)*sym++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static void symbols_insert(struct symbol **slots, int size,
+    struct symbol *symbol)
+{
+    int mask = size - 1;
+    int i = symbol->hash & mask;
+
+    while (slots[i])
+        i = (i + 1) & mask;
+
+    slots[i] = symbol;
+}
+
+static void symbols_rehash(int size)
+{
+    struct symbol **slots = calloc(size, sizeof(*slots));
+    int i;
+
+    if (!slots)
+        abort();
+
+    for (i = 0; i < symbols.size; ++i)
+    {
+        if (symbols.slots[i])
+            symbols_insert(slots, size, symbols.slots[i]);
+    }
+
+    free(symbols.slots);
+    symbols.slots = slots;
+    symbols.size = size;
+}
+
+struct symbol *atom_intern(const char *sym, int len)
+{
+    unsigned int hash = symbol_hash(sym, len);
+    struct symbol *symbol;
+    int i;
+
+    if (symbols.size)
+    {
+        int mask = symbols.size - 1;
+
+        for (i = hash & mask; (symbol = symbols.slots[i]);
+            i = (i + 1) & mask)
+        {
+            if (symbol->hash == hash && symbol->len == len &&
+                memcmp(symbol->name, sym, len) == 0)
+            {
+                return symbol;
+            }
+        }
+    }
+
+    symbol = gc_alloc(sizeof(*symbol) + len + 1, GC_STRING);
+    symbol->hash = hash;
+    symbol->len = len;
+    memcpy(symbol->name, sym, len);
+
+    if ((symbols.count + 1) * 2 > symbols.size)
+        symbols_rehash(symbols.size ? symbols.size * 2 : 256);
+
+    symbols_insert(symbols.slots, symbols.size, symbol);
+    symbols.count += 1;
+
+    return symbol;
+}
+
 struct atom *atom_new_sym(const char *sym, int len)
 {
-    struct atom *atom = atom_new_str(sym, len);
-    atom->type = ATOM_SYMBOL;
+    struct symbol *symbol = atom_intern(sym, len);
+    struct atom *atom = atom_new(ATOM_SYMBOL);
+    atom->str.str = symbol->name;
+    atom->str.len = len;
+    atom->str.hash = symbol->hash;
     return atom;
 }
 
-struct atom *atom_new_list(struct list *list)
+void atom_gc_sweep_symbols()
+{
+    int i;
+
+    for (i = 0; i < symbols.size; ++i)
+    {
+        if (symbols.slots[i] && !gc_is_marked(symbols.slots[i]))
+        {
+            symbols.slots[i] = NULL;
+            symbols.count -= 1;
+        }
+    }
+
+    // Rebuild to close the gaps left in the probe sequences.
+    symbols_rehash(symbols.size);
+}
+
+struct pair *pair_new(struct atom *car, struct pair *cdr)
+{
+    struct pair *pair = gc_alloc(sizeof(*pair), GC_PAIR);
+    pair->car = car;
+    pair->cdr = cdr;
+    return pair;
+}
+
+// Takes over a chain of pairs built by hand, walking it once to find
+// its end.
+
+struct atom *atom_new_list(struct pair *first)
 {
     struct atom *atom = atom_new(ATOM_LIST);
-    atom->list = list;
+    struct pair *pair;
+
+    atom->list.first = first;
+
+    for (pair = first; pair; pair = pair->cdr)
+    {
+        atom->list.last = pair;
+        atom->list.count += 1;
+    }
+
     return atom;
 }
 
 struct atom *atom_new_list_empty()
 {
-    struct list *list = calloc(1, sizeof(*list));
-    LIST_INIT(list);
-    return atom_new_list(list);
+    return atom_new_list(NULL);
+}
+
+struct atom *atom_new_primitive(const struct primitive *primitive)
+{
+    struct atom *atom = atom_new(ATOM_PRIMITIVE);
+    atom->primitive = primitive;
+    return atom;
+}
+
+// Vector elements are stored as they are, immediates included, in one
+// contiguous array. An empty vector has no array at all.
+
+struct atom *atom_new_vector(int len, struct atom *fill)
+{
+    struct atom *atom = atom_new(ATOM_VECTOR);
+    int i;
+
+    if (len)
+        atom->vector.items = gc_alloc(len * sizeof(struct atom *), GC_DATA);
+
+    atom->vector.len = len;
+
+    for (i = 0; i < len; ++i)
+        atom->vector.items[i] = fill;
+
+    return atom;
+}
+
+struct atom *atom_vector_from_list(struct atom *list)
+{
+    struct atom *vector = atom_new_vector(atom_list_length(list), &nil_atom);
+    struct pair *pair;
+    int i = 0;
+
+    for (pair = list->list.first; pair; pair = pair->cdr)
+        vector->vector.items[i++] = pair->car;
+
+    return vector;
+}
+
+struct atom *atom_vector_to_list(struct atom *vector)
+{
+    struct atom *list;
+    int i;
+
+    if (!vector->vector.len)
+        return &nil_atom;
+
+    list = atom_new_list_empty();
+
+    for (i = 0; i < vector->vector.len; ++i)
+        atom_list_push(list, vector->vector.items[i]);
+
+    return list;
 }
 
 struct atom *atom_new_closure(struct atom *params, struct atom *body,
@@ -76,57 +314,204 @@ struct atom *atom_new_closure(struct atom *params, struct atom *body,
 
 struct atom *atom_clone(struct atom *atom)
 {
-    switch (atom->type)
+    switch (ATOM_TYPE(atom))
     {
     case ATOM_NIL:
     case ATOM_TRUE:
     case ATOM_FALSE:
+    case ATOM_PRIMITIVE:
+    case ATOM_HASHMAP:
         return atom;
 
     case ATOM_INT:
-        return atom_new_int(atom->l);
+    {
+        struct atom *clone;
+
+        if (IS_FIXNUM(atom))
+            return atom;
+
+        clone = atom_new(ATOM_INT);
+        clone->l = atom->l;
+        return clone;
+    }
+
+    case ATOM_FLOAT:
+    {
+        struct atom *clone;
+
+        if (IS_FLONUM(atom))
+            return atom;
+
+        clone = atom_new(ATOM_FLOAT);
+        clone->d = atom->d;
+        return clone;
+    }
+
+    case ATOM_BIGNUM:
+    {
+        // The limbs are never modified, so they can be shared.
+        struct atom *clone = atom_new(ATOM_BIGNUM);
+        clone->big = atom->big;
+        return clone;
+    }
 
     case ATOM_STR:
         return atom_new_str(atom->str.str, atom->str.len);
 
     case ATOM_SYMBOL:
-        return atom_new_sym(atom->str.str, atom->str.len);
+    {
+        struct atom *clone = atom_new(ATOM_SYMBOL);
+        clone->str = atom->str;
+        return clone;
+    }
 
     case ATOM_LIST:
     {
-        struct atom *elem, *last;
-
-        struct list *list_clone = calloc(1, sizeof(*list_clone));
-        LIST_INIT(list_clone);
+        struct atom *clone = atom_new_list_empty();
+        struct pair *pair;
 
-        LIST_FOREACH(elem, atom->list, entries)
-        {
-            struct atom *a_clone = atom_clone(elem);
-
-            if (LIST_EMPTY(list_clone))
-                LIST_INSERT_HEAD(list_clone, a_clone, entries);
-            else
-                LIST_INSERT_AFTER(last, a_clone, entries);
+        for (pair = atom->list.first; pair; pair = pair->cdr)
+            atom_list_push(clone, atom_clone(pair->car));
 
-            last = a_clone;
-        }
-
-        return atom_new_list(list_clone);
+        return clone;
     }
 
     case ATOM_CLOSURE:
+    {
         // TODO: should we clone the env or what? If it is just plainly
         // cloned, it leads to a infinite loop when we have a closure
         // bound to a name in the env.
-        return atom_new_closure(atom_clone(atom->closure.params),
+        struct atom *clone = atom_new_closure(
+            atom_clone(atom->closure.params),
             atom_clone(atom->closure.body),
             atom->closure.env);
-        break;
+        clone->closure.proto = atom->closure.proto;
+        clone->closure.node = atom->closure.node;
+        return clone;
+    }
+
+    case ATOM_VECTOR:
+    {
+        struct atom *clone = atom_new_vector(atom->vector.len, &nil_atom);
+        int i;
+
+        for (i = 0; i < atom->vector.len; ++i)
+            clone->vector.items[i] = atom_clone(atom->vector.items[i]);
+
+        return clone;
+    }
+
+    case ATOM_ARRAY:
+    {
+        struct atom *clone = atom_new(ATOM_ARRAY);
+
+        clone->array = atom->array;
+
+        if (atom->array.len)
+        {
+            clone->array.data = gc_alloc(ARRAY_SIZE(atom), GC_DATA);
+            memcpy(clone->array.data, atom->array.data, ARRAY_SIZE(atom));
+        }
+
+        return clone;
+    }
     }
 
     return NULL;
 }
 
+void atom_gc_trace(struct atom *atom)
+{
+    switch (ATOM_TYPE(atom))
+    {
+    case ATOM_STR:
+    case ATOM_SYMBOL:
+        gc_mark(atom->str.str);
+        break;
+
+    case ATOM_LIST:
+        gc_mark(atom->list.first);
+        break;
+
+    case ATOM_CLOSURE:
+        gc_mark(atom->closure.env);
+        gc_mark(atom->closure.params);
+        gc_mark(atom->closure.body);
+        gc_mark(atom->closure.proto);
+        gc_mark(atom->closure.node);
+        break;
+
+    case ATOM_VECTOR:
+    {
+        int i;
+
+        gc_mark(atom->vector.items);
+
+        for (i = 0; i < atom->vector.len; ++i)
+            gc_mark(atom->vector.items[i]);
+
+        break;
+    }
+
+    case ATOM_HASHMAP:
+    {
+        int i;
+
+        gc_mark(atom->hash.entries);
+
+        for (i = 0; i < atom->hash.size; ++i)
+        {
+            gc_mark(atom->hash.entries[i].key);
+            gc_mark(atom->hash.entries[i].value);
+        }
+
+        break;
+    }
+
+    case ATOM_ARRAY:
+        gc_mark(atom->array.data);
+        break;
+
+    case ATOM_BIGNUM:
+        gc_mark(atom->big.limbs);
+        break;
+    }
+}
+
+// Long lists are not traced recursively: gc_mark only queues the next
+// pair.
+
+void pair_gc_trace(struct pair *pair)
+{
+    gc_mark(pair->car);
+    gc_mark(pair->cdr);
+}
+
+// Prints the shortest form that reads back as the same double, with a
+// decimal point so that it cannot be mistaken for an integer.
+
+static void print_float(double d)
+{
+    char buf[32];
+    int precision;
+
+    for (precision = 15; precision < 17; ++precision)
+    {
+        snprintf(buf, sizeof(buf), "%.*g", precision, d);
+
+        if (strtod(buf, NULL) == d)
+            break;
+    }
+
+    if (precision == 17)
+        snprintf(buf, sizeof(buf), "%.17g", d);
+
+    if (!strpbrk(buf, ".ein"))
+        strcat(buf, ".0");
+
+    printf("%s", buf);
+}
+
 void print_atom(struct atom *atom, int level)
 {
     switch (ATOM_TYPE(atom))
@@ -144,17 +529,17 @@ void print_atom(struct atom *atom, int level)
         break;
 
     case ATOM_INT:
-        printf("%ld", atom->l);
+        printf("%ld", INT_VAL(atom));
         break;
 
     case ATOM_LIST:
     {
         printf("(");
-        struct atom *elem;
-        LIST_FOREACH(elem, atom->list, entries)
+        struct pair *pair;
+        for (pair = atom->list.first; pair; pair = pair->cdr)
         {
-            print_atom(elem, level+1);
-            if (LIST_NEXT(elem, entries))
+            print_atom(pair->car, level+1);
+            if (pair->cdr)
                 printf(" ");
         }
         printf(")");
@@ -164,36 +549,83 @@ void print_atom(struct atom *atom, int level)
     case ATOM_CLOSURE:
         printf("<closure@%p>", atom);
         break;
+
+    case ATOM_PRIMITIVE:
+        printf("<primitive %s>", atom->primitive->name);
+        break;
+
+    case ATOM_VECTOR:
+    {
+        int i;
+
+        printf("#(");
+        for (i = 0; i < atom->vector.len; ++i)
+        {
+            print_atom(atom->vector.items[i], level+1);
+            if (i + 1 < atom->vector.len)
+                printf(" ");
+        }
+        printf(")");
+        break;
+    }
+
+    case ATOM_HASHMAP:
+        printf("<hash@%p>", atom);
+        break;
+
+    case ATOM_FLOAT:
+        print_float(FLOAT_VAL(atom));
+        break;
+
+    case ATOM_BIGNUM:
+        bignum_print(atom);
+        break;
+
+    case ATOM_ARRAY:
+    {
+        int i;
+
+        printf(atom->array.elem == ARRAY_I64 ? "#i64(" : "#f64(");
+        for (i = 0; i < atom->array.len; ++i)
+        {
+            if (atom->array.elem == ARRAY_I64)
+                printf("%lld", (long long)((int64_t *)atom->array.data)[i]);
+            else
+                print_float(((double *)atom->array.data)[i]);
+            if (i + 1 < atom->array.len)
+                printf(" ");
+        }
+        printf(")");
+        break;
+    }
     }
 
     if (level == 0)
         printf("\n");
 }
 
+void atom_list_push(struct atom *list, struct atom *value)
+{
+    struct pair *pair = pair_new(value, NULL);
+
+    if (list->list.last)
+        list->list.last->cdr = pair;
+    else
+        list->list.first = pair;
+
+    list->list.last = pair;
+    list->list.count += 1;
+}
+
 struct atom *atom_list_append(struct atom *list, int count, ...)
 {
     va_list ap;
-    struct atom *atom = NULL;
-    struct atom *last;
-
-    LIST_FOREACH(last, list->list, entries)
-    {
-        if (!LIST_NEXT(last, entries))
-            break;
-    }
 
     va_start(ap, count);
 
     do
     {
-        atom = va_arg(ap, struct atom *);
-
-        if (LIST_EMPTY(list->list))
-            LIST_INSERT_HEAD(list->list, atom, entries);
-        else
-            LIST_INSERT_AFTER(last, atom, entries);
-
-        last = atom;
+        atom_list_push(list, va_arg(ap, struct atom *));
     } while (--count);
 
     va_end(ap);
@@ -203,18 +635,341 @@ struct atom *atom_list_append(struct atom *list, int count, ...)
 
 int atom_list_length(struct atom *list)
 {
-    struct atom *atom;
-    int length = 0;
+    return list->list.count;
+}
+
+int atom_cmp(struct atom *a, struct atom *b)
+{
+    if (ATOM_TYPE(a) != ATOM_TYPE(b))
+        return 0;
 
-    if (IS_NIL(list))
+    if (IS_TRUE(a) && !IS_TRUE(b))
         return 0;
 
-    LIST_FOREACH(atom, list->list, entries)
+    if (IS_FALSE(a) && !IS_FALSE(b))
+        return 0;
+
+    if (IS_TRUE(b) && !IS_TRUE(a))
+        return 0;
+
+    if (IS_FALSE(b) && !IS_FALSE(a))
+        return 0;
+
+    if (IS_NIL(a) && !IS_NIL(b))
+        return 0;
+
+    if (IS_NIL(b) && !IS_NIL(a))
+        return 0;
+
+    int result = 1;
+
+    switch (ATOM_TYPE(a))
     {
-        ++length;
+        case ATOM_INT:
+            if (INT_VAL(a) != INT_VAL(b))
+                result = 0;
+            break;
+
+        case ATOM_STR:
+            if (strcmp(a->str.str, b->str.str) != 0)
+                result = 0;
+            break;
+
+        case ATOM_SYMBOL:
+            if (!SYM_EQ(a, b))
+                result = 0;
+            break;
+
+        case ATOM_LIST:
+        {
+            struct pair *ai = a->list.first;
+            struct pair *bi = b->list.first;
+
+            while (ai && bi)
+            {
+                if (!atom_cmp(ai->car, bi->car))
+                {
+                    result = 0;
+                    break;
+                }
+
+                ai = ai->cdr;
+                bi = bi->cdr;
+            }
+
+            if (ai != NULL || bi != NULL)
+                result = 0;
+
+            break;
+        }
+
+        case ATOM_HASHMAP:
+            result = a == b;
+            break;
+
+        case ATOM_FLOAT:
+            if (FLOAT_VAL(a) != FLOAT_VAL(b))
+                result = 0;
+            break;
+
+        case ATOM_BIGNUM:
+            if (bignum_cmp(a, b) != 0)
+                result = 0;
+            break;
+
+        case ATOM_ARRAY:
+            if (a->array.elem != b->array.elem ||
+                a->array.len != b->array.len ||
+                memcmp(a->array.data, b->array.data, ARRAY_SIZE(a)) != 0)
+            {
+                result = 0;
+            }
+            break;
+
+        case ATOM_VECTOR:
+        {
+            int i;
+
+            if (a->vector.len != b->vector.len)
+                return 0;
+
+            for (i = 0; i < a->vector.len; ++i)
+            {
+                if (!atom_cmp(a->vector.items[i], b->vector.items[i]))
+                    return 0;
+            }
+
+            break;
+        }
     }
 
-    return length;
+    return result;
+}
+
+// Equal atoms (see atom_cmp) hash to the same value.
+
+unsigned int atom_hash(struct atom *atom)
+{
+    unsigned int hash = 2166136261u;
+
+    switch (ATOM_TYPE(atom))
+    {
+    case ATOM_INT:
+    {
+        unsigned long l = INT_VAL(atom);
+        return (unsigned int)((l ^ (l >> 32)) * 2654435761u);
+    }
+
+    case ATOM_STR:
+    {
+        // atom_cmp compares strings up to the first NUL.
+        const char *str = atom->str.str;
+
+        while (*str)
+        {
+            hash ^= (unsigned char)*str++;
+            hash *= 16777619u;
+        }
+
+        return hash;
+    }
+
+    case ATOM_SYMBOL:
+        return atom->str.hash;
+
+    case ATOM_LIST:
+    {
+        struct pair *pair;
+
+        for (pair = atom->list.first; pair; pair = pair->cdr)
+            hash = (hash ^ atom_hash(pair->car)) * 16777619u;
+
+        return hash;
+    }
+
+    case ATOM_VECTOR:
+    {
+        int i;
+
+        for (i = 0; i < atom->vector.len; ++i)
+            hash = (hash ^ atom_hash(atom->vector.items[i])) * 16777619u;
+
+        return hash ^ ATOM_VECTOR;
+    }
+
+    case ATOM_HASHMAP:
+        return (unsigned int)((uintptr_t)atom >> 4);
+
+    case ATOM_FLOAT:
+    {
+        // 0.0 and -0.0 are equal but differ in their bits.
+        double d = FLOAT_VAL(atom) == 0 ? 0 : FLOAT_VAL(atom);
+        uint64_t bits;
+
+        memcpy(&bits, &d, sizeof(bits));
+        return (unsigned int)((bits ^ (bits >> 32)) * 2654435761u);
+    }
+
+    case ATOM_BIGNUM:
+    {
+        int i;
+
+        for (i = 0; i < atom->big.len; ++i)
+            hash = (hash ^ atom->big.limbs[i]) * 16777619u;
+
+        return hash ^ atom->big.negative;
+    }
+
+    case ATOM_ARRAY:
+    {
+        const unsigned char *data = atom->array.data;
+        size_t i;
+
+        for (i = 0; i < ARRAY_SIZE(atom); ++i)
+            hash = (hash ^ data[i]) * 16777619u;
+
+        return hash ^ atom->array.elem;
+    }
+    }
+
+    return ATOM_TYPE(atom);
+}
+
+// Hash maps use open addressing with linear probing. Removing an entry
+// shifts the following entries of its probe sequence back, so lookups
+// can stop at the first empty slot without any tombstones.
+
+static struct hash_entry *hash_find(struct atom *map, struct atom *key,
+    unsigned int hash)
+{
+    int mask = map->hash.size - 1;
+    int i;
+
+    if (!map->hash.size)
+        return NULL;
+
+    for (i = hash & mask; map->hash.entries[i].key; i = (i + 1) & mask)
+    {
+        struct hash_entry *entry = &map->hash.entries[i];
+
+        if (entry->hash == hash && atom_cmp(entry->key, key))
+            return entry;
+    }
+
+    return NULL;
+}
+
+static void hash_resize(struct atom *map, int size)
+{
+    struct hash_entry *old = map->hash.entries;
+    int old_size = map->hash.size;
+    int mask = size - 1;
+    int i;
+
+    map->hash.entries = gc_alloc(size * sizeof(*old), GC_DATA);
+    map->hash.size = size;
+
+    for (i = 0; i < old_size; ++i)
+    {
+        int j;
+
+        if (!old[i].key)
+            continue;
+
+        j = old[i].hash & mask;
+
+        while (map->hash.entries[j].key)
+            j = (j + 1) & mask;
+
+        map->hash.entries[j] = old[i];
+    }
+}
+
+struct atom *atom_new_hash()
+{
+    return atom_new(ATOM_HASHMAP);
+}
+
+struct atom *atom_hash_ref(struct atom *map, struct atom *key)
+{
+    struct hash_entry *entry = hash_find(map, key, atom_hash(key));
+    return entry ? entry->value : NULL;
+}
+
+void atom_hash_set(struct atom *map, struct atom *key, struct atom *value)
+{
+    unsigned int hash = atom_hash(key);
+    struct hash_entry *entry = hash_find(map, key, hash);
+    int mask, i;
+
+    if (entry)
+    {
+        entry->value = value;
+        return;
+    }
+
+    if ((map->hash.count + 1) * 2 > map->hash.size)
+        hash_resize(map, map->hash.size ? map->hash.size * 2 : 8);
+
+    mask = map->hash.size - 1;
+
+    i = hash & mask;
+
+    while (map->hash.entries[i].key)
+        i = (i + 1) & mask;
+
+    map->hash.entries[i].key = key;
+    map->hash.entries[i].value = value;
+    map->hash.entries[i].hash = hash;
+    map->hash.count += 1;
+}
+
+int atom_hash_remove(struct atom *map, struct atom *key)
+{
+    struct hash_entry *entry = hash_find(map, key, atom_hash(key));
+    int mask = map->hash.size - 1;
+    int i, j;
+
+    if (!entry)
+        return 0;
+
+    i = entry - map->hash.entries;
+
+    // Move back every entry that would no longer be found past the hole.
+    for (j = (i + 1) & mask; map->hash.entries[j].key; j = (j + 1) & mask)
+    {
+        int home = map->hash.entries[j].hash & mask;
+
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            map->hash.entries[i] = map->hash.entries[j];
+            i = j;
+        }
+    }
+
+    memset(&map->hash.entries[i], 0, sizeof(map->hash.entries[i]));
+    map->hash.count -= 1;
+
+    return 1;
+}
+
+struct atom *atom_hash_keys(struct atom *map)
+{
+    struct atom *list;
+    int i;
+
+    if (!map->hash.count)
+        return &nil_atom;
+
+    list = atom_new_list_empty();
+
+    for (i = 0; i < map->hash.size; ++i)
+    {
+        if (map->hash.entries[i].key)
+            atom_list_push(list, map->hash.entries[i].key);
+    }
+
+    return list;
 }
 
 #ifdef BUILD_TEST
@@ -225,14 +980,64 @@ TEST(atom_new)
 {
     struct atom *atom = atom_new(ATOM_STR);
     ASSERT_TRUE(atom != NULL);
-    ASSERT_EQ(ATOM_STR, atom->type);
+    ASSERT_EQ(ATOM_STR, ATOM_TYPE(atom));
 }
 
 TEST(atom_new_int)
 {
     struct atom *atom = atom_new_int(42);
     ASSERT_TRUE(atom != NULL);
-    ASSERT_EQ(42, atom->l);
+    ASSERT_TRUE(IS_FIXNUM(atom));
+    ASSERT_TRUE(IS_INT(atom));
+    ASSERT_EQ(42, INT_VAL(atom));
+
+    atom = atom_new_int(-42);
+    ASSERT_TRUE(IS_FIXNUM(atom));
+    ASSERT_EQ(-42, INT_VAL(atom));
+
+    atom = atom_new_int(LONG_MAX);
+    ASSERT_FALSE(IS_FIXNUM(atom));
+    ASSERT_TRUE(IS_INT(atom));
+    ASSERT_EQ(LONG_MAX, INT_VAL(atom));
+
+    atom = atom_new_int(FIXNUM_MIN);
+    ASSERT_TRUE(IS_FIXNUM(atom));
+    ASSERT_EQ(FIXNUM_MIN, INT_VAL(atom));
+}
+
+TEST(atom_box)
+{
+    struct atom *atom = atom_box(atom_new_int(7));
+    ASSERT_FALSE(IS_FIXNUM(atom));
+    ASSERT_EQ(ATOM_INT, ATOM_TYPE(atom));
+    ASSERT_EQ(7, INT_VAL(atom));
+    ASSERT_EQ(atom, atom_box(atom));
+}
+
+TEST(atom_new_float)
+{
+    static const double values[] = {
+        0.0, -0.0, 1.0, -1.5, 3.14159, 1e-70, 1e70, 1e-300, 1e300,
+        2.0000000000000004, 0x1p-255, 0x1p256, 1.0 / 0.0, -1.0 / 0.0
+    };
+    unsigned i;
+
+    for (i = 0; i < sizeof(values) / sizeof(values[0]); ++i)
+    {
+        struct atom *atom = atom_new_float(values[i]);
+        double d = FLOAT_VAL(atom);
+
+        ASSERT_EQ(ATOM_FLOAT, ATOM_TYPE(atom));
+        ASSERT_EQ(0, memcmp(&d, &values[i], sizeof(d)));
+
+        atom = atom_box(atom);
+        ASSERT_FALSE(IS_IMMEDIATE(atom));
+        ASSERT_TRUE(FLOAT_VAL(atom) == values[i]);
+    }
+
+    ASSERT_TRUE(IS_FLONUM(atom_new_float(1.5)));
+    ASSERT_TRUE(IS_FLONUM(atom_new_float(0.0)));
+    ASSERT_FALSE(IS_FLONUM(atom_new_float(1e300)));
 }
 
 TEST(atom_new_str)
@@ -245,7 +1050,7 @@ TEST(atom_new_str)
     ASSERT_TRUE(atom != NULL);
     ASSERT_STREQ("foo", atom->str.str);
 
-    ASSERT_EQ(ATOM_STR, atom->type);
+    ASSERT_EQ(ATOM_STR, ATOM_TYPE(atom));
 }
 
 TEST(atom_new_sym)
@@ -258,16 +1063,74 @@ TEST(atom_new_sym)
     ASSERT_TRUE(atom != NULL);
     ASSERT_STREQ("foo", atom->str.str);
 
-    ASSERT_EQ(ATOM_SYMBOL, atom->type);
+    ASSERT_EQ(ATOM_SYMBOL, ATOM_TYPE(atom));
+}
+
+TEST(atom_new_sym_interns)
+{
+    struct atom *a = atom_new_sym("foobar", 6);
+    struct atom *b = atom_new_sym("foobarbaz", 6);
+    struct atom *c = atom_new_sym("foo", 3);
+
+    ASSERT_TRUE(SYM_EQ(a, b));
+    ASSERT_FALSE(SYM_EQ(a, c));
+    ASSERT_TRUE(SYM_EQ(a, atom_clone(a)));
+    ASSERT_EQ(a->str.hash, b->str.hash);
 }
 
 TEST(atom_new_list)
 {
-    struct list list;
-    struct atom *atom = atom_new_list(&list);
+    struct pair pair = { atom_new_int(1), NULL };
+    struct atom *atom = atom_new_list(&pair);
     ASSERT_TRUE(atom != NULL);
-    ASSERT_EQ(&list, atom->list);
-    ASSERT_EQ(ATOM_LIST, atom->type);
+    ASSERT_EQ(&pair, atom->list.first);
+    ASSERT_EQ(ATOM_LIST, ATOM_TYPE(atom));
+}
+
+TEST(list_append_keeps_last_and_count)
+{
+    struct atom *list = atom_new_list_empty();
+    int i;
+
+    ASSERT_EQ(0, atom_list_length(list));
+    ASSERT_TRUE(list->list.last == NULL);
+
+    for (i = 0; i < 1000; ++i)
+    {
+        atom_list_push(list, atom_new_int(i));
+        ASSERT_EQ(i + 1, atom_list_length(list));
+        ASSERT_EQ(i, INT_VAL(CAR(list->list.last)));
+        ASSERT_TRUE(CDR(list->list.last) == NULL);
+    }
+
+    atom_list_append(list, 2, &true_atom, &false_atom);
+    ASSERT_EQ(1002, atom_list_length(list));
+    ASSERT_TRUE(IS_FALSE(CAR(list->list.last)));
+    ASSERT_EQ(0, INT_VAL(CAR(list->list.first)));
+
+    ASSERT_EQ(1002, atom_list_length(atom_new_list(list->list.first)));
+    ASSERT_EQ(1002, atom_list_length(atom_clone(list)));
+    ASSERT_EQ(0, atom_list_length(&nil_atom));
+}
+
+TEST(lists_share_tails)
+{
+    struct atom *a = atom_new_sym("a", 1);
+    struct atom *tail = atom_list_append(atom_new_list_empty(), 2,
+        atom_new_int(2), atom_new_int(3));
+    struct atom *one = atom_new_list(pair_new(atom_new_int(1),
+        tail->list.first));
+    struct atom *two = atom_new_list(pair_new(a, tail->list.first));
+
+    ASSERT_EQ(sizeof(void *) * 2, sizeof(struct pair));
+
+    ASSERT_EQ(3, atom_list_length(one));
+    ASSERT_EQ(3, atom_list_length(two));
+    ASSERT_TRUE(CDR(one->list.first) == CDR(two->list.first));
+    ASSERT_TRUE(atom_cmp(atom_new_list(CDR(one->list.first)), tail));
+
+    // Immediates are stored in the pairs as they are.
+    ASSERT_TRUE(IS_FIXNUM(CAR(CDR(two->list.first))));
 }
 
 #endif
@@ -1,9 +1,42 @@
 #ifndef ATOM_H
 #define ATOM_H
 
-#include <sys/queue.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
-#define ATOM_TYPE(ATOM) ((ATOM)->type)
+// Integers that fit in a pointer shifted left by one are stored directly
+// in the pointer with the lowest bit set ("fixnums") and never allocate.
+// Always go through ATOM_TYPE and INT_VAL when a value may be a fixnum.
+
+#define FIXNUM_MIN (LONG_MIN >> 1)
+#define FIXNUM_MAX (LONG_MAX >> 1)
+
+#define IS_FIXNUM(ATOM) (((uintptr_t)(ATOM)) & 1)
+#define FIXNUM(L) ((struct atom *)(((uintptr_t)(long)(L) << 1) | 1))
+#define FIXNUM_VAL(ATOM) (((intptr_t)(ATOM)) >> 1)
+
+// On 64-bit targets most doubles are immediate as well ("flonums"),
+// tagged with 10 in the two lowest bits. Those whose exponent is close
+// enough to zero (magnitudes between about 1e-77 and 1e77) have three
+// bits to spare at the top; rotating the double left by three moves them
+// to the bottom where the tag goes (see atom_new_float). Other doubles
+// are boxed, and FLOAT_VAL reads either kind.
+
+#if UINTPTR_MAX > 0xffffffffu
+#define IS_FLONUM(ATOM) ((((uintptr_t)(ATOM)) & 3) == 2)
+#define FLONUM_ZERO ((uintptr_t)0x8000000000000002u)
+#else
+#define IS_FLONUM(ATOM) 0
+#endif
+
+#define IS_IMMEDIATE(ATOM) (((uintptr_t)(ATOM)) & 3)
+
+#define ATOM_TYPE(ATOM) (IS_IMMEDIATE(ATOM) ? \
+    (IS_FIXNUM(ATOM) ? ATOM_INT : ATOM_FLOAT) : (ATOM)->type)
+#define INT_VAL(ATOM) (IS_FIXNUM(ATOM) ? FIXNUM_VAL(ATOM) : (ATOM)->l)
+#define FLOAT_VAL(ATOM) (IS_FLONUM(ATOM) ? flonum_val(ATOM) : (ATOM)->d)
 
 #define IS_INT(ATOM) ((ATOM_TYPE(ATOM)) == ATOM_INT)
 #define IS_STR(ATOM) ((ATOM_TYPE(ATOM)) == ATOM_STR)
@@ -17,10 +50,24 @@
 #define IS_NIL(ATOM) (ATOM_TYPE(ATOM) == ATOM_NIL)
 
 #define IS_CLOSURE(ATOM) (ATOM_TYPE(ATOM) == ATOM_CLOSURE)
+#define IS_PRIMITIVE(ATOM) (ATOM_TYPE(ATOM) == ATOM_PRIMITIVE)
+#define IS_VECTOR(ATOM) (ATOM_TYPE(ATOM) == ATOM_VECTOR)
+#define IS_HASHMAP(ATOM) (ATOM_TYPE(ATOM) == ATOM_HASHMAP)
+#define IS_FLOAT(ATOM) (ATOM_TYPE(ATOM) == ATOM_FLOAT)
+#define IS_ARRAY(ATOM) (ATOM_TYPE(ATOM) == ATOM_ARRAY)
+#define IS_BIGNUM(ATOM) (ATOM_TYPE(ATOM) == ATOM_BIGNUM)
 
-#define CAR(LIST) (LIST_FIRST(LIST))
-#define CDR(LIST) ((LIST) != NULL ? LIST_NEXT((LIST), entries) : NULL)
-#define CDDR(LIST) CDR(CDR(LIST))
+// Symbol names are interned, so symbols compare by pointer.
+#define SYM_EQ(A, B) ((A)->str.str == (B)->str.str)
+#define SYMBOL(ATOM) \
+    ((struct symbol *)((ATOM)->str.str - offsetof(struct symbol, name)))
+
+// Lists are chains of pairs (see struct pair). CDR of NULL is NULL, so
+// the elements of a form can be picked out without checking its length
+// first.
+#define CAR(PAIR) ((PAIR)->car)
+#define CDR(PAIR) ((PAIR) != NULL ? (PAIR)->cdr : NULL)
+#define CDDR(PAIR) CDR(CDR(PAIR))
 
 enum
 {
@@ -31,20 +78,92 @@ enum
     ATOM_LIST,
     ATOM_TRUE,
     ATOM_FALSE,
-    ATOM_CLOSURE
+    ATOM_CLOSURE,
+    ATOM_PRIMITIVE,
+    ATOM_VECTOR,
+    ATOM_HASHMAP,
+    ATOM_FLOAT,
+    ATOM_ARRAY,
+    ATOM_BIGNUM
+};
+
+// Element types of numeric arrays (see array.h). Elements of either
+// type take eight bytes.
+enum
+{
+    ARRAY_I64,
+    ARRAY_F64
 };
 
+#define ARRAY_SIZE(ATOM) ((size_t)(ATOM)->array.len * 8)
+
 struct atom;
 struct env;
+struct proto;
+struct node;
+
+typedef struct atom *(*special_form_t)(struct atom *expr, struct env *env);
+
+// The canonical copy of a symbol name. Special forms are recognized by
+// the evaluator through the special field of their symbol.
+struct symbol
+{
+    special_form_t special;
+    unsigned int hash;
+    int len;
+    char name[];
+};
+
+// A builtin function. Arguments are evaluated before fn is called, and
+// the caller checks their count against min_args/max_args (-1 for no
+// upper limit).
+struct primitive
+{
+    const char *name;
+    struct atom *(*fn)(struct atom **args, int argc);
+    int min_args;
+    int max_args;
+};
+
+// proto and node are the compiled and the analyzed body, filled in when
+// the closure is first run by the VM (see vm.h) or by analyze_run.
 
 struct closure
 {
     struct env *env;
     struct atom *params;
     struct atom *body;
+    struct proto *proto;
+    struct node *node;
 };
 
-LIST_HEAD(list, atom);
+struct hash_entry
+{
+    struct atom *key;
+    struct atom *value;
+    unsigned int hash;
+};
+
+// A cons cell: 16 bytes on 64-bit targets. Any value can be the car,
+// immediates included, and a value can be in any number of lists; tails
+// are shared rather than copied. The cdr of the last pair is NULL.
+struct pair
+{
+    struct atom *car;
+    struct pair *cdr;
+};
+
+// The empty list has no pairs. The parser reads () as nil, though.
+// last and count let atom_list_append add elements in constant time and
+// make atom_list_length constant time as well. A list that shares its
+// tail shares the last pair too, so lists must not be appended to once
+// they are built and possibly shared.
+struct list
+{
+    struct pair *first;
+    struct pair *last;
+    int count;
+};
 
 struct atom
 {
@@ -53,33 +172,96 @@ struct atom
     union
     {
         long l;
+        double d;
         struct
         {
             char *str;
             int len;
+            unsigned int hash;
         } str;
-        struct list *list;
+        struct list list;
+        struct
+        {
+            struct atom **items;
+            int len;
+        } vector;
+        struct
+        {
+            struct hash_entry *entries;
+            int count;
+            int size;
+        } hash;
+        struct
+        {
+            void *data;
+            int len;
+            char elem;
+        } array;
+        struct
+        {
+            uint32_t *limbs;
+            int len;
+            char negative;
+        } big;
         struct closure closure;
+        const struct primitive *primitive;
     };
-
-    LIST_ENTRY(atom) entries;
 };
 
+static inline double flonum_val(const struct atom *atom)
+{
+    uint64_t bits = (uintptr_t)atom;
+    double d = 0;
+
+#if UINTPTR_MAX > 0xffffffffu
+    if (bits != FLONUM_ZERO)
+    {
+        // Restore the two top exponent bits from the one that was kept.
+        bits = (2 - (bits >> 63)) | (bits & ~(uint64_t)3);
+        bits = bits >> 3 | bits << 61;
+        memcpy(&d, &bits, sizeof(d));
+    }
+#endif
+
+    return d;
+}
+
 struct atom *atom_new(char type);
 struct atom *atom_new_int(long l);
+struct atom *atom_box(struct atom *atom);
+struct atom *atom_new_float(double d);
 struct atom *atom_new_str(const char *str, int len);
 struct atom *atom_new_sym(const char *sym, int len);
-struct atom *atom_new_list(struct list *list);
+struct symbol *atom_intern(const char *sym, int len);
+struct pair *pair_new(struct atom *car, struct pair *cdr);
+struct atom *atom_new_list(struct pair *first);
 struct atom *atom_new_list_empty();
 struct atom *atom_new_closure(struct atom *params, struct atom *body,
     struct env *env);
+struct atom *atom_new_primitive(const struct primitive *primitive);
+struct atom *atom_new_vector(int len, struct atom *fill);
+struct atom *atom_vector_from_list(struct atom *list);
+struct atom *atom_vector_to_list(struct atom *vector);
+struct atom *atom_new_hash();
+struct atom *atom_hash_ref(struct atom *map, struct atom *key);
+void atom_hash_set(struct atom *map, struct atom *key, struct atom *value);
+int atom_hash_remove(struct atom *map, struct atom *key);
+struct atom *atom_hash_keys(struct atom *map);
 struct atom *atom_clone();
 
 void print_atom(struct atom *atom, int level);
 
+void atom_gc_trace(struct atom *atom);
+void pair_gc_trace(struct pair *pair);
+void atom_gc_sweep_symbols();
+
+void atom_list_push(struct atom *list, struct atom *value);
 struct atom *atom_list_append(struct atom *list, int count, ...);
 int atom_list_length(struct atom *list);
 
+int atom_cmp(struct atom *a, struct atom *b);
+unsigned int atom_hash(struct atom *atom);
+
 extern struct atom true_atom;
 extern struct atom false_atom;
 extern struct atom nil_atom;
@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "tokens.h"
+
+// Measures the throughput of the tokenizer on a generated source of
+// SIZE bytes, with the byte at a time scanners and with the SIMD ones.
+
+#define SIZE (64 * 1024 * 1024)
+#define ROUNDS 5
+
+static const char *sample =
+    "(define (process-record record)\n"
+    "    ;; Look up the customer and update the running totals\n"
+    "    (let ((customer-name \"Bartholomew Featherstonehaugh\")\n"
+    "          (amount 12345.678e-2))\n"
+    "        (update-totals! customer-name amount '(quarterly report))))\n"
+    "\n";
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double tokenize_all(const char *src, long *tokens)
+{
+    struct token token;
+    double start = now();
+    int pos = 0;
+
+    *tokens = 0;
+
+    while (get_next_token(src, &pos, &token) > 0)
+        *tokens += 1;
+
+    return now() - start;
+}
+
+static void run(const char *name, const char *src)
+{
+    double best = 0;
+    long tokens = 0;
+    int i;
+
+    for (i = 0; i < ROUNDS; ++i)
+    {
+        double seconds = tokenize_all(src, &tokens);
+
+        if (!i || seconds < best)
+            best = seconds;
+    }
+
+    printf("%-7s %8.1f MB/s  (%ld tokens)\n", name,
+        SIZE / best / (1024 * 1024), tokens);
+}
+
+int main()
+{
+    char *src = malloc(SIZE + 1);
+    size_t len = strlen(sample);
+    size_t i;
+
+    for (i = 0; i + len <= SIZE; i += len)
+        memcpy(src + i, sample, len);
+
+    memset(src + i, ' ', SIZE - i);
+    src[SIZE] = '\0';
+
+    tokens_use_simd(0);
+    run("scalar", src);
+
+    if (tokens_use_simd(1))
+        run("simd", src);
+
+    free(src);
+
+    return 0;
+}
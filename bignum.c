@@ -0,0 +1,640 @@
+#include "bignum.h"
+#include "atom.h"
+#include "gc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Products of this many limbs and more are split by Karatsuba's method,
+// which trades one of the four half-size products for a few additions.
+// Below it plain long multiplication is faster.
+
+#ifndef KARATSUBA_THRESHOLD
+#define KARATSUBA_THRESHOLD 32
+#endif
+
+#define LIMB_BITS 32
+
+struct big
+{
+    uint32_t *limbs;
+    int len;
+    int negative;
+};
+
+static uint32_t *limbs_new(int len)
+{
+    return gc_alloc((len ? len : 1) * sizeof(uint32_t), GC_DATA);
+}
+
+static void *scratch(int len)
+{
+    void *limbs = calloc(len ? len : 1, sizeof(uint32_t));
+
+    if (!limbs)
+        abort();
+
+    return limbs;
+}
+
+static int mag_trim(const uint32_t *a, int len)
+{
+    while (len && !a[len - 1])
+        --len;
+
+    return len;
+}
+
+static int mag_cmp(const uint32_t *a, int an, const uint32_t *b, int bn)
+{
+    an = mag_trim(a, an);
+    bn = mag_trim(b, bn);
+
+    if (an != bn)
+        return an < bn ? -1 : 1;
+
+    while (an--)
+    {
+        if (a[an] != b[an])
+            return a[an] < b[an] ? -1 : 1;
+    }
+
+    return 0;
+}
+
+// r = a + b, with room for max(an, bn) + 1 limbs. r may be a or b.
+// Returns the length of r.
+
+static int mag_add(uint32_t *r, const uint32_t *a, int an, const uint32_t *b,
+    int bn)
+{
+    uint64_t carry = 0;
+    int i;
+
+    if (an < bn)
+    {
+        const uint32_t *t = a;
+        int tn = an;
+
+        a = b;
+        an = bn;
+        b = t;
+        bn = tn;
+    }
+
+    for (i = 0; i < an; ++i)
+    {
+        carry += (uint64_t)a[i] + (i < bn ? b[i] : 0);
+        r[i] = (uint32_t)carry;
+        carry >>= LIMB_BITS;
+    }
+
+    r[an] = (uint32_t)carry;
+
+    return an + 1;
+}
+
+// a -= b, where a >= b.
+
+static void mag_sub(uint32_t *a, int an, const uint32_t *b, int bn)
+{
+    int64_t borrow = 0;
+    int i;
+
+    for (i = 0; i < an && (i < bn || borrow); ++i)
+    {
+        int64_t t = (int64_t)a[i] - (i < bn ? b[i] : 0) - borrow;
+
+        a[i] = (uint32_t)t;
+        borrow = t < 0;
+    }
+}
+
+// Adds a into r at limb offset off. The sum must fit in the rn limbs of r.
+
+static void mag_add_at(uint32_t *r, int rn, const uint32_t *a, int an, int off)
+{
+    uint64_t carry = 0;
+    int i;
+
+    for (i = 0; off + i < rn && (i < an || carry); ++i)
+    {
+        carry += (uint64_t)r[off + i] + (i < an ? a[i] : 0);
+        r[off + i] = (uint32_t)carry;
+        carry >>= LIMB_BITS;
+    }
+}
+
+static void mag_mul_long(uint32_t *r, const uint32_t *a, int an,
+    const uint32_t *b, int bn)
+{
+    int i, j;
+
+    memset(r, 0, (an + bn) * sizeof(*r));
+
+    for (i = 0; i < an; ++i)
+    {
+        uint64_t carry = 0;
+
+        for (j = 0; j < bn; ++j)
+        {
+            carry += (uint64_t)a[i] * b[j] + r[i + j];
+            r[i + j] = (uint32_t)carry;
+            carry >>= LIMB_BITS;
+        }
+
+        r[i + bn] = (uint32_t)carry;
+    }
+}
+
+// r = a * b, filling all an + bn limbs of r, which must not overlap a or b.
+//
+// With a = a1 B^k + a0 and b = b1 B^k + b0 the product is
+// z2 B^2k + z1 B^k + z0, where z0 = a0 b0, z2 = a1 b1 and
+// z1 = (a0 + a1)(b0 + b1) - z0 - z2.
+
+static void mag_mul(uint32_t *r, const uint32_t *a, int an, const uint32_t *b,
+    int bn)
+{
+    uint32_t *sa, *sb, *z1;
+    int k, san, sbn, z1n;
+
+    if (an < bn)
+    {
+        const uint32_t *t = a;
+        int tn = an;
+
+        a = b;
+        an = bn;
+        b = t;
+        bn = tn;
+    }
+
+    if (bn < KARATSUBA_THRESHOLD)
+    {
+        mag_mul_long(r, a, an, b, bn);
+        return;
+    }
+
+    k = an / 2;
+
+    // b is too short to be split: multiply it by both halves of a.
+    if (bn <= k)
+    {
+        uint32_t *high = scratch(an - k + bn);
+
+        mag_mul(r, a, k, b, bn);
+        memset(r + k + bn, 0, (an - k) * sizeof(*r));
+        mag_mul(high, a + k, an - k, b, bn);
+        mag_add_at(r, an + bn, high, an - k + bn, k);
+
+        free(high);
+        return;
+    }
+
+    mag_mul(r, a, k, b, k);
+    mag_mul(r + 2 * k, a + k, an - k, b + k, bn - k);
+
+    sa = scratch(an - k + 1);
+    sb = scratch(bn - k + 1 > k + 1 ? bn - k + 1 : k + 1);
+    san = mag_add(sa, a, k, a + k, an - k);
+    sbn = mag_add(sb, b, k, b + k, bn - k);
+
+    z1n = san + sbn;
+    z1 = scratch(z1n);
+    mag_mul(z1, sa, san, sb, sbn);
+    mag_sub(z1, z1n, r, 2 * k);
+    mag_sub(z1, z1n, r + 2 * k, an + bn - 2 * k);
+    mag_add_at(r, an + bn, z1, mag_trim(z1, z1n), k);
+
+    free(sa);
+    free(sb);
+    free(z1);
+}
+
+// q = a / d for a single limb d. Returns the remainder. q may be a.
+
+static uint32_t mag_div_limb(uint32_t *q, const uint32_t *a, int an,
+    uint32_t d)
+{
+    uint64_t rem = 0;
+
+    while (an--)
+    {
+        rem = rem << LIMB_BITS | a[an];
+        q[an] = (uint32_t)(rem / d);
+        rem %= d;
+    }
+
+    return (uint32_t)rem;
+}
+
+// Long division (Knuth's algorithm D): q gets an - bn + 1 limbs and rem
+// bn limbs. Needs an >= bn and a nonzero top limb of b.
+
+static void mag_divmod(uint32_t *q, uint32_t *rem, const uint32_t *a, int an,
+    const uint32_t *b, int bn)
+{
+    uint32_t *un, *vn;
+    int s, i, j;
+
+    if (bn == 1)
+    {
+        rem[0] = mag_div_limb(q, a, an, b[0]);
+        return;
+    }
+
+    // Shift so that the top limb of the divisor has its high bit set,
+    // which keeps the estimated quotient digits off by at most two.
+    s = __builtin_clz(b[bn - 1]);
+    un = scratch(an + 1);
+    vn = scratch(bn);
+
+    for (i = bn - 1; i > 0; --i)
+        vn[i] = b[i] << s | (s ? b[i - 1] >> (LIMB_BITS - s) : 0);
+    vn[0] = b[0] << s;
+
+    un[an] = s ? a[an - 1] >> (LIMB_BITS - s) : 0;
+    for (i = an - 1; i > 0; --i)
+        un[i] = a[i] << s | (s ? a[i - 1] >> (LIMB_BITS - s) : 0);
+    un[0] = a[0] << s;
+
+    for (j = an - bn; j >= 0; --j)
+    {
+        uint64_t num = (uint64_t)un[j + bn] << LIMB_BITS | un[j + bn - 1];
+        uint64_t qhat = num / vn[bn - 1];
+        uint64_t rhat = num % vn[bn - 1];
+        int64_t borrow = 0, t;
+
+        while (qhat >> LIMB_BITS ||
+            qhat * vn[bn - 2] > (rhat << LIMB_BITS | un[j + bn - 2]))
+        {
+            --qhat;
+            rhat += vn[bn - 1];
+
+            if (rhat >> LIMB_BITS)
+                break;
+        }
+
+        for (i = 0; i < bn; ++i)
+        {
+            uint64_t p = qhat * vn[i];
+
+            t = (int64_t)un[i + j] - borrow - (int64_t)(p & 0xffffffff);
+            un[i + j] = (uint32_t)t;
+            borrow = (int64_t)(p >> LIMB_BITS) - (t >> LIMB_BITS);
+        }
+
+        t = (int64_t)un[j + bn] - borrow;
+        un[j + bn] = (uint32_t)t;
+
+        // The estimate was one too large: add the divisor back.
+        if (t < 0)
+        {
+            uint64_t carry = 0;
+
+            --qhat;
+
+            for (i = 0; i < bn; ++i)
+            {
+                carry += (uint64_t)un[i + j] + vn[i];
+                un[i + j] = (uint32_t)carry;
+                carry >>= LIMB_BITS;
+            }
+
+            un[j + bn] += (uint32_t)carry;
+        }
+
+        q[j] = (uint32_t)qhat;
+    }
+
+    for (i = 0; i < bn; ++i)
+        rem[i] = un[i] >> s | (s ? un[i + 1] << (LIMB_BITS - s) : 0);
+
+    free(un);
+    free(vn);
+}
+
+// Views an integer atom as a struct big. The limbs of an ATOM_INT are
+// stored in buf.
+
+static void big_view(struct atom *atom, struct big *big, uint32_t buf[2])
+{
+    if (IS_BIGNUM(atom))
+    {
+        big->limbs = atom->big.limbs;
+        big->len = atom->big.len;
+        big->negative = atom->big.negative;
+        return;
+    }
+
+    {
+        long l = INT_VAL(atom);
+        uint64_t mag = l < 0 ? -(uint64_t)l : (uint64_t)l;
+
+        buf[0] = (uint32_t)mag;
+        buf[1] = (uint32_t)(mag >> LIMB_BITS);
+        big->limbs = buf;
+        big->len = mag_trim(buf, 2);
+        big->negative = l < 0;
+    }
+}
+
+// Makes an integer atom from a magnitude in collected memory, as an
+// ATOM_INT whenever the value fits in a long.
+
+static struct atom *big_result(uint32_t *limbs, int len, int negative)
+{
+    struct atom *atom;
+
+    len = mag_trim(limbs, len);
+
+    if (len <= 2)
+    {
+        uint64_t mag = len ? limbs[0] : 0;
+
+        if (len == 2)
+            mag |= (uint64_t)limbs[1] << LIMB_BITS;
+
+        if (!negative && mag <= LONG_MAX)
+            return atom_new_int((long)mag);
+
+        if (negative && mag <= (uint64_t)LONG_MAX + 1)
+            return atom_new_int((long)-mag);
+    }
+
+    atom = atom_new(ATOM_BIGNUM);
+    atom->big.limbs = limbs;
+    atom->big.len = len;
+    atom->big.negative = negative;
+
+    return atom;
+}
+
+static struct atom *big_add(struct big *a, struct big *b, int b_negative)
+{
+    int len = (a->len > b->len ? a->len : b->len) + 1;
+    uint32_t *r = limbs_new(len);
+
+    if (a->negative == b_negative)
+    {
+        mag_add(r, a->limbs, a->len, b->limbs, b->len);
+        return big_result(r, len, a->negative);
+    }
+
+    if (mag_cmp(a->limbs, a->len, b->limbs, b->len) >= 0)
+    {
+        memcpy(r, a->limbs, a->len * sizeof(*r));
+        mag_sub(r, len, b->limbs, b->len);
+        return big_result(r, len, a->negative);
+    }
+
+    memcpy(r, b->limbs, b->len * sizeof(*r));
+    mag_sub(r, len, a->limbs, a->len);
+
+    return big_result(r, len, b_negative);
+}
+
+static struct atom *big_divmod(struct big *a, struct big *b, int mod)
+{
+    uint32_t *q, *rem;
+    int qn;
+
+    if (mag_cmp(a->limbs, a->len, b->limbs, b->len) < 0)
+    {
+        if (!mod)
+            return atom_new_int(0);
+
+        rem = limbs_new(a->len);
+        memcpy(rem, a->limbs, a->len * sizeof(*rem));
+
+        return big_result(rem, a->len, a->negative);
+    }
+
+    qn = a->len - b->len + 1;
+    q = limbs_new(qn);
+    rem = limbs_new(b->len);
+    mag_divmod(q, rem, a->limbs, a->len, b->limbs, b->len);
+
+    if (mod)
+        return big_result(rem, b->len, a->negative);
+
+    return big_result(q, qn, a->negative != b->negative);
+}
+
+struct atom *bignum_arith(char op, struct atom *a, struct atom *b)
+{
+    uint32_t abuf[2], bbuf[2];
+    struct big x, y;
+
+    big_view(a, &x, abuf);
+    big_view(b, &y, bbuf);
+
+    switch (op)
+    {
+    case '+':
+        return big_add(&x, &y, y.negative);
+
+    case '-':
+        return big_add(&x, &y, !y.negative);
+
+    case '*':
+    {
+        uint32_t *r = limbs_new(x.len + y.len);
+
+        if (x.len && y.len)
+            mag_mul(r, x.limbs, x.len, y.limbs, y.len);
+
+        return big_result(r, x.len + y.len, x.negative != y.negative);
+    }
+
+    case '/':
+        return big_divmod(&x, &y, 0);
+
+    case '%':
+        return big_divmod(&x, &y, 1);
+    }
+
+    return &nil_atom;
+}
+
+int bignum_cmp(struct atom *a, struct atom *b)
+{
+    uint32_t abuf[2], bbuf[2];
+    struct big x, y;
+    int cmp;
+
+    big_view(a, &x, abuf);
+    big_view(b, &y, bbuf);
+
+    if (x.negative != y.negative)
+        return x.negative ? -1 : 1;
+
+    cmp = mag_cmp(x.limbs, x.len, y.limbs, y.len);
+
+    return x.negative ? -cmp : cmp;
+}
+
+double bignum_to_double(struct atom *atom)
+{
+    double d = 0;
+    int i;
+
+    for (i = atom->big.len - 1; i >= 0; --i)
+        d = d * 4294967296.0 + atom->big.limbs[i];
+
+    return atom->big.negative ? -d : d;
+}
+
+// Digits are converted nine at a time, as 10^9 fits in a limb.
+
+#define CHUNK 1000000000u
+#define CHUNK_DIGITS 9
+
+struct atom *bignum_parse(const char *digits, int len)
+{
+    uint32_t *r = limbs_new(len / CHUNK_DIGITS + 1);
+    int rn = 0;
+    int i = 0;
+
+    while (i < len)
+    {
+        int n = len - i < CHUNK_DIGITS ? len - i : CHUNK_DIGITS;
+        uint64_t carry = 0, scale = 1;
+        int j;
+
+        for (j = 0; j < n; ++j)
+        {
+            carry = carry * 10 + (digits[i + j] - '0');
+            scale *= 10;
+        }
+
+        // r = r * scale + carry
+        for (j = 0; j < rn; ++j)
+        {
+            carry += r[j] * scale;
+            r[j] = (uint32_t)carry;
+            carry >>= LIMB_BITS;
+        }
+
+        if (carry)
+            r[rn++] = (uint32_t)carry;
+
+        i += n;
+    }
+
+    return big_result(r, rn, 0);
+}
+
+void bignum_print(struct atom *atom)
+{
+    int len = atom->big.len;
+    uint32_t *mag = scratch(len);
+    uint32_t *chunks = scratch(len * 2 + 1);
+    int count = 0;
+
+    memcpy(mag, atom->big.limbs, len * sizeof(*mag));
+
+    while (len)
+    {
+        chunks[count++] = mag_div_limb(mag, mag, len, CHUNK);
+        len = mag_trim(mag, len);
+    }
+
+    printf("%s%u", atom->big.negative ? "-" : "", chunks[--count]);
+
+    while (count--)
+        printf("%09u", chunks[count]);
+
+    free(mag);
+    free(chunks);
+}
+
+#ifdef BUILD_TEST
+
+#include "test_util.h"
+
+static struct atom *number(const char *digits)
+{
+    return bignum_parse(digits, strlen(digits));
+}
+
+TEST(bignum_normalizes_to_long)
+{
+    struct atom *big = number("9223372036854775808");
+    struct atom *result;
+
+    ASSERT_TRUE(IS_BIGNUM(big));
+    ASSERT_TRUE(IS_INT(number("9223372036854775807")));
+
+    result = bignum_arith('-', big, atom_new_int(1));
+    ASSERT_TRUE(IS_INT(result));
+    ASSERT_EQ(LONG_MAX, INT_VAL(result));
+
+    result = bignum_arith('-', atom_new_int(0), big);
+    ASSERT_TRUE(IS_INT(result));
+    ASSERT_EQ(LONG_MIN, INT_VAL(result));
+
+    ASSERT_TRUE(bignum_cmp(big, atom_new_int(LONG_MAX)) > 0);
+    ASSERT_TRUE(bignum_cmp(bignum_arith('-', atom_new_int(0), big),
+        atom_new_int(LONG_MIN)) == 0);
+}
+
+// (10^n - 1)^2 = 10^2n - 2 10^n + 1, checked through division as well,
+// with sizes on both sides of the Karatsuba threshold.
+
+TEST(bignum_karatsuba_agrees_with_division)
+{
+    static const int sizes[] = { 5, 40, 300, 1000, 2000 };
+    unsigned i;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        int n = sizes[i];
+        char *digits = malloc(2 * n + 2);
+        struct atom *a, *power, *square, *expected;
+
+        memset(digits, '9', n);
+        digits[n] = 0;
+        a = number(digits);
+
+        digits[0] = '1';
+        memset(digits + 1, '0', 2 * n);
+        digits[2 * n + 1] = 0;
+        expected = number(digits);
+
+        digits[n + 1] = 0;
+        power = number(digits);
+
+        expected = bignum_arith('-', expected,
+            bignum_arith('*', atom_new_int(2), power));
+        expected = bignum_arith('+', expected, atom_new_int(1));
+
+        square = bignum_arith('*', a, a);
+        ASSERT_EQ(0, bignum_cmp(square, expected));
+
+        ASSERT_EQ(0, bignum_cmp(bignum_arith('/', square, a), a));
+        ASSERT_EQ(0, bignum_cmp(bignum_arith('%', square, a),
+            atom_new_int(0)));
+        ASSERT_EQ(0, bignum_cmp(bignum_arith('%', bignum_arith('+', square,
+            atom_new_int(12345)), a), atom_new_int(12345)));
+
+        free(digits);
+    }
+}
+
+TEST(bignum_division_truncates)
+{
+    struct atom *big = number("100000000000000000000000000007");
+    struct atom *minus = bignum_arith('-', atom_new_int(0), big);
+    struct atom *result;
+
+    result = bignum_arith('%', minus, atom_new_int(10));
+    ASSERT_EQ(-7, INT_VAL(result));
+
+    result = bignum_arith('/', minus, number("10000000000000000000000000000"));
+    ASSERT_EQ(-10, INT_VAL(result));
+}
+
+#endif /* BUILD_TEST */
@@ -0,0 +1,32 @@
+#ifndef BIGNUM_H
+#define BIGNUM_H
+
+#include "atom.h"
+
+// Integers that do not fit in a long are ATOM_BIGNUM atoms: a sign and a
+// magnitude of 32-bit limbs, least significant first. Results are always
+// normalized, so a bignum never holds a value a long could, and integer
+// equality can still compare types first.
+//
+// The functions below accept any mix of ATOM_INT and ATOM_BIGNUM.
+
+#define IS_INTEGER(ATOM) (IS_INT(ATOM) || IS_BIGNUM(ATOM))
+
+// Parses a string of len decimal digits.
+struct atom *bignum_parse(const char *digits, int len);
+
+// Computes a op b for op one of + - * / %, where / truncates and % takes
+// the sign of a. b must not be zero for / and %.
+struct atom *bignum_arith(char op, struct atom *a, struct atom *b);
+
+// Returns a negative number, zero or a positive number as a is less
+// than, equal to or greater than b.
+int bignum_cmp(struct atom *a, struct atom *b);
+
+// Converts to a double, rounding if needed; huge magnitudes give an
+// infinity.
+double bignum_to_double(struct atom *atom);
+
+void bignum_print(struct atom *atom);
+
+#endif
@@ -0,0 +1,518 @@
+#include "vm.h"
+#include "atom.h"
+#include "eval.h"
+#include "gc.h"
+#include "scope.h"
+#include "env.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Compiles expressions into the bytecode run by vm_run.
+//
+// Every lambda becomes its own struct proto, and calling it creates one
+// environment frame with a slot for each parameter and for each symbol
+// defined in its body. A reference to a symbol bound by one of the
+// enclosing lambdas is therefore compiled to the frame depth and slot
+// where it lives (OP_LOAD_LOCAL). Any other symbol is global: it is
+// looked up by name from the environment the top-level expression runs
+// in, so that it sees later defines.
+
+struct compiler
+{
+    struct proto *proto;
+    struct scope *scope;
+
+    uint16_t *code;
+    int code_len;
+    int code_capacity;
+
+    int depth;
+
+    // Set when an operand or jump target does not fit in a code word.
+    int too_large;
+};
+
+static void *grow(void *array, int *capacity, size_t elem_size)
+{
+    *capacity = *capacity ? *capacity * 2 : 16;
+    array = realloc(array, *capacity * elem_size);
+
+    if (!array)
+        abort();
+
+    return array;
+}
+
+static void emit(struct compiler *c, int word)
+{
+    if (word > UINT16_MAX)
+        c->too_large = 1;
+
+    if (c->code_len == c->code_capacity)
+        c->code = grow(c->code, &c->code_capacity, sizeof(*c->code));
+
+    c->code[c->code_len++] = word;
+}
+
+static void adjust_depth(struct compiler *c, int delta)
+{
+    c->depth += delta;
+
+    if (c->depth > c->proto->max_stack)
+        c->proto->max_stack = c->depth;
+}
+
+// The constant tables are grown in place so that the collector can see
+// the constants (and nested functions) added so far through the proto.
+
+static void *grow_table(void *table, int count, int *capacity)
+{
+    void *grown;
+
+    if (count < *capacity)
+        return table;
+
+    *capacity = *capacity ? *capacity * 2 : 8;
+    grown = gc_alloc(*capacity * sizeof(void *), GC_DATA);
+
+    if (count)
+        memcpy(grown, table, count * sizeof(void *));
+
+    return grown;
+}
+
+static int add_constant(struct compiler *c, struct atom *atom)
+{
+    struct proto *proto = c->proto;
+    int i;
+
+    for (i = 0; i < proto->constant_count; ++i)
+    {
+        struct atom *constant = proto->constants[i];
+
+        if (constant == atom ||
+            (IS_SYM(constant) && IS_SYM(atom) && SYM_EQ(constant, atom)))
+        {
+            return i;
+        }
+    }
+
+    proto->constants = grow_table(proto->constants, proto->constant_count,
+        &proto->constant_capacity);
+    proto->constants[proto->constant_count] = atom;
+
+    return proto->constant_count++;
+}
+
+static int add_proto(struct compiler *c, struct proto *nested)
+{
+    struct proto *proto = c->proto;
+
+    proto->protos = grow_table(proto->protos, proto->proto_count,
+        &proto->proto_capacity);
+    proto->protos[proto->proto_count] = nested;
+
+    return proto->proto_count++;
+}
+
+static void emit_constant(struct compiler *c, int op, struct atom *atom)
+{
+    emit(c, op);
+    emit(c, add_constant(c, atom));
+    adjust_depth(c, 1);
+}
+
+static void emit_error(struct compiler *c, const char *message)
+{
+    emit_constant(c, OP_ERROR, atom_new_str(message, strlen(message)));
+}
+
+static void compile_expr(struct compiler *c, struct atom *expr, int tail);
+
+static void compile_symbol(struct compiler *c, struct atom *symbol)
+{
+    int depth;
+    int slot = scope_resolve(c->scope, symbol, &depth);
+
+    if (slot >= 0)
+    {
+        emit(c, OP_LOAD_LOCAL);
+        emit(c, depth);
+        emit(c, slot);
+        emit(c, add_constant(c, symbol));
+    }
+    else
+    {
+        emit(c, OP_LOAD_GLOBAL);
+        emit(c, depth);
+        emit(c, add_constant(c, symbol));
+        emit(c, c->proto->cache_count++);
+    }
+
+    adjust_depth(c, 1);
+}
+
+static void compile_quote(struct compiler *c, struct pair *op)
+{
+    struct pair *value = CDR(op);
+
+    if (!value)
+    {
+        emit_error(c, "quote takes 1 argument");
+        return;
+    }
+
+    emit_constant(c, OP_CONST, CAR(value));
+}
+
+static void patch_jump(struct compiler *c, int at)
+{
+    if (c->code_len > UINT16_MAX)
+        c->too_large = 1;
+
+    c->code[at] = c->code_len;
+}
+
+// In tail position the true branch returns directly instead of jumping
+// over the false branch.
+
+static void compile_if(struct compiler *c, struct pair *op, int tail)
+{
+    struct pair *predicate = CDR(op);
+    struct pair *true_case = CDR(predicate);
+    struct pair *false_case = CDR(true_case);
+    int else_jump, end_jump = -1;
+
+    if (!predicate || !true_case || !false_case)
+    {
+        emit_error(c, "if takes 3 arguments");
+        return;
+    }
+
+    compile_expr(c, CAR(predicate), 0);
+
+    emit(c, OP_JUMP_UNLESS);
+    else_jump = c->code_len;
+    emit(c, 0);
+    adjust_depth(c, -1);
+
+    compile_expr(c, CAR(true_case), tail);
+
+    if (tail)
+    {
+        emit(c, OP_RETURN);
+    }
+    else
+    {
+        emit(c, OP_JUMP);
+        end_jump = c->code_len;
+        emit(c, 0);
+    }
+
+    adjust_depth(c, -1);
+
+    patch_jump(c, else_jump);
+    compile_expr(c, CAR(false_case), tail);
+
+    if (end_jump >= 0)
+        patch_jump(c, end_jump);
+}
+
+static void compile_define(struct compiler *c, struct pair *op)
+{
+    struct pair *value = CDDR(op);
+    struct atom *name;
+
+    if (!value)
+    {
+        emit_error(c, "define takes two arguments");
+        return;
+    }
+
+    name = CAR(CDR(op));
+
+    if (!IS_SYM(name))
+    {
+        emit_error(c, "define: first arg must be symbol");
+        return;
+    }
+
+    compile_expr(c, CAR(value), 0);
+
+    // Inside a lambda the name has a slot in the current frame.
+    if (c->scope)
+    {
+        emit(c, OP_DEFINE_LOCAL);
+        emit(c, scope_slot(c->scope, name));
+    }
+    else
+    {
+        emit(c, OP_DEFINE);
+    }
+
+    emit(c, add_constant(c, name));
+}
+
+static struct proto *compile_function(struct scope *parent,
+    struct atom *params, struct atom *body);
+
+static void compile_lambda_form(struct compiler *c, struct pair *op)
+{
+    const char *error = lambda_syntax_error(op);
+    struct pair *params = CDR(op);
+    struct proto *proto;
+
+    if (error)
+    {
+        emit_error(c, error);
+        return;
+    }
+
+    proto = compile_function(c->scope, CAR(params), CAR(CDR(params)));
+
+    emit(c, OP_CLOSURE);
+    emit(c, add_proto(c, proto));
+    adjust_depth(c, 1);
+}
+
+static void compile_call(struct compiler *c, struct atom *expr, int tail)
+{
+    struct pair *arg;
+    int argc = expr->list.count - 1;
+    int skip;
+
+    compile_expr(c, CAR(expr->list.first), 0);
+
+    emit(c, OP_CHECK_CALL);
+    emit(c, argc);
+    skip = c->code_len;
+    emit(c, 0);
+
+    for (arg = CDR(expr->list.first); arg; arg = CDR(arg))
+        compile_expr(c, CAR(arg), 0);
+
+    emit(c, tail ? OP_TAIL_CALL : OP_CALL);
+    emit(c, argc);
+    adjust_depth(c, -argc);
+
+    patch_jump(c, skip);
+}
+
+// Calls in tail position (where the value of expr is what the function
+// returns) are compiled to OP_TAIL_CALL. A failed OP_CHECK_CALL skips the
+// arguments and the call; in tail position the OP_RETURN that always
+// follows then returns nil.
+
+static void compile_expr(struct compiler *c, struct atom *expr, int tail)
+{
+    struct pair *op;
+
+    if (IS_SYM(expr))
+    {
+        compile_symbol(c, expr);
+        return;
+    }
+
+    if (!IS_LIST(expr))
+    {
+        emit_constant(c, OP_CONST, expr);
+        return;
+    }
+
+    op = expr->list.first;
+
+    if (IS_SYM(CAR(op)) && SYMBOL(CAR(op))->special)
+    {
+        special_form_t special = SYMBOL(CAR(op))->special;
+
+        if (special == &builtin_quote)
+            compile_quote(c, op);
+        else if (special == &builtin_if)
+            compile_if(c, op, tail);
+        else if (special == &builtin_define)
+            compile_define(c, op);
+        else if (special == &builtin_lambda)
+            compile_lambda_form(c, op);
+        else
+            emit_error(c, "unsupported special form");
+
+        return;
+    }
+
+    compile_call(c, expr, tail);
+}
+
+static struct proto *compile_body(struct scope *scope, struct atom *expr)
+{
+    struct compiler c;
+
+    memset(&c, 0, sizeof(c));
+
+    c.scope = scope;
+    c.proto = gc_alloc(sizeof(*c.proto), GC_PROTO);
+
+    compile_expr(&c, expr, 1);
+    emit(&c, OP_RETURN);
+
+    // Operands are 16 bits wide, so a function with too many constants,
+    // arguments or code words compiles to an error instead.
+    if (c.too_large)
+    {
+        c.code_len = 0;
+        c.depth = 0;
+        c.too_large = 0;
+        c.proto->constant_count = 0;
+        c.proto->proto_count = 0;
+        c.proto->cache_count = 0;
+        c.proto->max_stack = 0;
+
+        emit_error(&c, "function too large");
+        emit(&c, OP_RETURN);
+    }
+
+    c.proto->code = gc_alloc(c.code_len * sizeof(*c.code), GC_DATA);
+    memcpy(c.proto->code, c.code, c.code_len * sizeof(*c.code));
+    c.proto->code_len = c.code_len;
+
+    if (c.proto->cache_count)
+    {
+        c.proto->caches = gc_alloc(
+            c.proto->cache_count * sizeof(*c.proto->caches), GC_DATA);
+    }
+
+    free(c.code);
+
+    return c.proto;
+}
+
+static struct proto *compile_function(struct scope *parent,
+    struct atom *params, struct atom *body)
+{
+    struct scope scope;
+    struct proto *proto;
+
+    scope_init(&scope, parent, params, body);
+
+    proto = compile_body(&scope, body);
+    proto->params = params;
+    proto->body = body;
+    proto->param_count = atom_list_length(params);
+    proto->slots = scope_copy_slots(&scope);
+    proto->slot_count = scope.slot_count;
+
+    scope_release(&scope);
+
+    return proto;
+}
+
+struct proto *compile(struct atom *expr)
+{
+    return compile_body(NULL, expr);
+}
+
+// Compiles a lambda on its own, as is needed for closures created by the
+// tree-walking evaluator. Only its own frame is known; everything else is
+// looked up by name from the closure environment.
+
+struct proto *compile_lambda(struct atom *params, struct atom *body)
+{
+    return compile_function(NULL, params, body);
+}
+
+void proto_gc_trace(struct proto *proto)
+{
+    int i;
+
+    gc_mark(proto->code);
+    gc_mark(proto->constants);
+    gc_mark(proto->protos);
+    gc_mark(proto->slots);
+    gc_mark(proto->params);
+    gc_mark(proto->body);
+
+    for (i = 0; i < proto->constant_count; ++i)
+        gc_mark(proto->constants[i]);
+
+    for (i = 0; i < proto->proto_count; ++i)
+        gc_mark(proto->protos[i]);
+
+    for (i = 0; i < proto->slot_count; ++i)
+        gc_mark(proto->slots[i]);
+
+    gc_mark(proto->caches);
+
+    // While the proto is being compiled cache_count grows, but the caches
+    // are only allocated at the end.
+    for (i = 0; proto->caches && i < proto->cache_count; ++i)
+    {
+        gc_mark(proto->caches[i].env);
+        gc_mark(proto->caches[i].value);
+    }
+}
+
+#ifdef BUILD_TEST
+
+#include "test_util.h"
+#include "parse.h"
+#include "env.h"
+
+TEST(compile_resolves_lexical_variables)
+{
+    int pos = 0;
+    struct atom *expr = parse("(lambda (x) (lambda (y z) (+ x z)))", &pos);
+    struct proto *outer = compile(expr)->protos[0];
+    struct proto *inner = outer->protos[0];
+
+    // + x z
+    ASSERT_EQ(OP_LOAD_GLOBAL, inner->code[0]);
+    ASSERT_EQ(2, inner->code[1]);
+    ASSERT_EQ(0, inner->code[3]);
+    ASSERT_EQ(OP_CHECK_CALL, inner->code[4]);
+    ASSERT_EQ(2, inner->code[5]);
+    ASSERT_EQ(17, inner->code[6]);
+    ASSERT_EQ(OP_LOAD_LOCAL, inner->code[7]);
+    ASSERT_EQ(1, inner->code[8]);
+    ASSERT_EQ(0, inner->code[9]);
+    ASSERT_EQ(OP_LOAD_LOCAL, inner->code[11]);
+    ASSERT_EQ(0, inner->code[12]);
+    ASSERT_EQ(1, inner->code[13]);
+    ASSERT_EQ(OP_TAIL_CALL, inner->code[15]);
+    ASSERT_EQ(2, inner->code[16]);
+    ASSERT_EQ(OP_RETURN, inner->code[17]);
+    ASSERT_EQ(1, inner->cache_count);
+    ASSERT_EQ(3, inner->max_stack);
+}
+
+TEST(compile_reports_syntax_errors_at_runtime)
+{
+    int pos = 0;
+    struct proto *proto = compile(parse("(if 1 2)", &pos));
+
+    ASSERT_EQ(OP_ERROR, proto->code[0]);
+    ASSERT_TRUE(IS_NIL(vm_run(proto, env_new())));
+}
+
+TEST(compile_rejects_operands_over_16_bits)
+{
+    int count = 66000;
+    char *src = malloc(count * 2 + 7);
+    struct proto *proto;
+    int pos = 0;
+    int i;
+
+    strcpy(src, "(list");
+    for (i = 0; i < count; ++i)
+        memcpy(src + 5 + i * 2, " 7", 2);
+    strcpy(src + 5 + count * 2, ")");
+
+    proto = compile(parse(src, &pos));
+    free(src);
+
+    ASSERT_EQ(OP_ERROR, proto->code[0]);
+    ASSERT_STREQ("function too large",
+        proto->constants[proto->code[1]]->str.str);
+    ASSERT_TRUE(IS_NIL(vm_run(proto, env_new())));
+}
+
+#endif /* BUILD_TEST */
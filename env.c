@@ -1,71 +1,241 @@
 #include "env.h"
 #include "atom.h"
+#include "gc.h"
 
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 
+// Frames with at most this many bindings are searched linearly. Larger
+// frames (typically the top-level one) switch to an open-addressing hash
+// table keyed by the symbol hash.
+#define ENV_HASH_THRESHOLD 8
+
+// Symbols are keyed by their interned name (see atom_intern), so
+// bindings are matched by pointer.
+
 struct kv
 {
     const char *symbol;
+    unsigned int hash;
     struct atom *value;
-    LIST_ENTRY(kv) entries;
 };
 
+// An environment is a frame holding the bindings introduced at one level
+// plus a link to the enclosing frame. Lookups walk the chain outwards, so
+// extending an environment never copies the bindings of its parents.
+//
+// While table_size is zero the first count entries of bindings are used
+// as a plain array. Otherwise bindings is a table of table_size slots
+// (a power of two) where empty slots have a NULL symbol.
+//
+// Frames made by env_extend_slots start with slot_count bindings whose
+// positions are fixed, so they never switch to a hash table. A binding
+// with a NULL value is not bound yet.
+
+struct env
+{
+    struct env *parent;
+    int count;
+    int capacity;
+    int table_size;
+    int slot_count;
+    struct kv *bindings;
+};
+
+unsigned long env_version = 1;
+
+static size_t cache_hits;
+static size_t cache_misses;
+
+// Only lookups from top-level environments are cached, so only those
+// and the builtins they enclose are global.
+static int env_is_global(struct env *env)
+{
+    return !env->parent || !env->parent->parent;
+}
+
+static struct env *env_alloc(struct env *parent)
+{
+    struct env *env = gc_alloc(sizeof(*env), GC_ENV);
+    env->parent = parent;
+    return env;
+}
+
+struct env *env_builtins()
+{
+    static struct env *builtins;
+
+    if (!builtins)
+    {
+        builtins = env_alloc(NULL);
+        gc_add_root_env(builtins);
+    }
+
+    return builtins;
+}
+
 struct env *env_new()
 {
-    struct env *env = calloc(1, sizeof(*env));
-    LIST_INIT(env);
+    struct env *env = env_alloc(env_builtins());
+    gc_add_root_env(env);
     return env;
 }
 
-struct atom *env_lookup(struct env *env, const char *symbol)
+static struct kv *env_find(struct env *env, const char *symbol,
+    unsigned int hash)
 {
-    struct kv *elem;
-    LIST_FOREACH(elem, env, entries)
+    int i;
+
+    if (env->table_size)
     {
-        if (strcmp(elem->symbol, symbol) == 0)
-            return elem->value;
+        unsigned int mask = env->table_size - 1;
+
+        for (i = hash & mask; env->bindings[i].symbol;
+            i = (i + 1) & mask)
+        {
+            if (env->bindings[i].symbol == symbol)
+                return &env->bindings[i];
+        }
+
+        return NULL;
+    }
+
+    // Backwards, so that the last of duplicated parameters wins.
+    for (i = env->count - 1; i >= 0; --i)
+    {
+        if (env->bindings[i].symbol == symbol)
+            return &env->bindings[i];
     }
 
     return NULL;
 }
 
-int env_set_(struct env *env, const char *symbol,
-    struct atom *atom, int force)
+static void env_insert_hashed(struct kv *table, int table_size,
+    struct kv *kv)
 {
-    struct kv *elem = NULL;
-    struct kv *kv;
+    unsigned int mask = table_size - 1;
+    unsigned int i = kv->hash & mask;
 
-    LIST_FOREACH(elem, env, entries)
+    while (table[i].symbol)
+        i = (i + 1) & mask;
+
+    table[i] = *kv;
+}
+
+// Makes room for one more binding, converting the frame to a hash table
+// once it grows past ENV_HASH_THRESHOLD and keeping the table at most
+// half full.
+
+static void env_reserve(struct env *env)
+{
+    struct kv *bindings;
+    int i, size;
+
+    if (!env->table_size &&
+        (env->count < ENV_HASH_THRESHOLD || env->slot_count))
     {
-        if (strcmp(symbol, elem->symbol) == 0)
-        {
-            if (!force)
-                return 0;
+        if (env->count < env->capacity)
+            return;
 
-            elem->value = atom;
+        size = env->capacity ? env->capacity * 2 : 2;
 
-            return 1;
-        }
+        bindings = gc_alloc(size * sizeof(*bindings), GC_KV);
+
+        if (env->count)
+            memcpy(bindings, env->bindings, env->count * sizeof(*bindings));
+
+        env->bindings = bindings;
+        env->capacity = size;
 
-        if (!LIST_NEXT(elem, entries))
-            break;
+        return;
     }
 
-    kv = calloc(1, sizeof(*kv));
-    kv->symbol = strdup(symbol);
-    kv->value = atom;
+    if (env->table_size && (env->count + 1) * 2 <= env->table_size)
+        return;
 
-    if (LIST_EMPTY(env))
+    size = env->table_size ? env->table_size * 2 : ENV_HASH_THRESHOLD * 4;
+    bindings = gc_alloc(size * sizeof(*bindings), GC_KV);
+
+    if (env->table_size)
     {
-        LIST_INSERT_HEAD(env, kv, entries);
+        for (i = 0; i < env->table_size; ++i)
+        {
+            if (env->bindings[i].symbol)
+                env_insert_hashed(bindings, size, &env->bindings[i]);
+        }
     }
     else
     {
-        LIST_INSERT_AFTER(elem, kv, entries);
+        for (i = 0; i < env->count; ++i)
+            env_insert_hashed(bindings, size, &env->bindings[i]);
+    }
+
+    env->bindings = bindings;
+    env->table_size = size;
+    env->capacity = size;
+}
+
+static struct atom *env_lookup_(struct env *env, const char *symbol,
+    unsigned int hash)
+{
+    for (; env; env = env->parent)
+    {
+        struct kv *kv = env_find(env, symbol, hash);
+
+        if (kv && kv->value)
+            return kv->value;
+    }
+
+    return NULL;
+}
+
+struct atom *env_lookup_sym(struct env *env, struct atom *symbol)
+{
+    return env_lookup_(env, symbol->str.str, symbol->str.hash);
+}
+
+struct atom *env_lookup(struct env *env, const char *symbol)
+{
+    struct symbol *sym = atom_intern(symbol, strlen(symbol));
+    return env_lookup_(env, sym->name, sym->hash);
+}
+
+static int env_set_(struct env *env, const char *symbol,
+    unsigned int hash, struct atom *atom, int force)
+{
+    struct kv *kv = env_find(env, symbol, hash);
+    struct kv binding;
+
+    if (kv)
+    {
+        if (!force && kv->value)
+            return 0;
+
+        kv->value = atom;
+
+        if (env_is_global(env))
+            env_version += 1;
+
+        return 1;
     }
 
+    env_reserve(env);
+
+    binding.symbol = symbol;
+    binding.hash = hash;
+    binding.value = atom;
+
+    if (env->table_size)
+        env_insert_hashed(env->bindings, env->table_size, &binding);
+    else
+        env->bindings[env->count] = binding;
+
+    env->count += 1;
+
+    if (env_is_global(env))
+        env_version += 1;
+
     return 1;
 }
 
@@ -74,7 +244,7 @@ struct env *env_extend(struct env *env, int count, ...)
     va_list ap;
     int i;
 
-    struct env *result = env_clone(env);
+    struct env *result = env_alloc(env);
 
     va_start(ap, count);
 
@@ -82,7 +252,9 @@ struct env *env_extend(struct env *env, int count, ...)
     {
         const char *symbol = va_arg(ap, const char *);
         struct atom *atom = va_arg(ap, struct atom *);
-        env_set_(result, symbol, atom, 1);
+        struct symbol *sym = atom_intern(symbol, strlen(symbol));
+
+        env_set_(result, sym->name, sym->hash, atom, 1);
     }
 
     va_end(ap);
@@ -90,38 +262,121 @@ struct env *env_extend(struct env *env, int count, ...)
     return result;
 }
 
-int env_set(struct env *env, const char *symbol,
-    struct atom *value)
+// The bindings of a slot frame are allocated together with the frame, so
+// a call needs a single allocation whatever its arity.
+
+struct env *env_extend_slots(struct env *env, struct atom **symbols,
+    int count, struct atom **values, int value_count)
+{
+    struct env *result = gc_alloc(
+        sizeof(*result) + count * sizeof(*result->bindings), GC_ENV);
+    int i;
+
+    result->parent = env;
+
+    if (!count)
+        return result;
+
+    result->bindings = (struct kv *)(result + 1);
+    result->count = count;
+    result->capacity = count;
+    result->slot_count = count;
+
+    for (i = 0; i < count; ++i)
+    {
+        result->bindings[i].symbol = symbols[i]->str.str;
+        result->bindings[i].hash = symbols[i]->str.hash;
+    }
+
+    for (i = 0; i < value_count; ++i)
+        result->bindings[i].value = values[i];
+
+    return result;
+}
+
+struct atom **env_slot(struct env *env, int slot)
 {
-    return env_set_(env, symbol, value, 0);
+    return &env->bindings[slot].value;
 }
 
-void env_free(struct env *env)
+int env_define_slot(struct env *env, int slot, struct atom *value)
 {
+    if (env->bindings[slot].value)
+        return 0;
 
+    env->bindings[slot].value = value;
+
+    return 1;
 }
 
-struct env *env_clone(struct env *env)
+struct atom *env_lookup_cached(struct env *env, struct atom *symbol,
+    struct env_cache *cache)
 {
-    struct env *clone = env_new();
-    struct kv *elem, *last;
+    if (!env_is_global(env))
+        return env_lookup_sym(env, symbol);
 
-    LIST_FOREACH(elem, env, entries)
+    if (cache->env == env && cache->version == env_version)
     {
-        struct kv *kv_clone = calloc(1, sizeof(*kv_clone));
+        cache_hits += 1;
+        return cache->value;
+    }
 
-        kv_clone->symbol = strdup(elem->symbol);
-        kv_clone->value = atom_clone(elem->value);
+    cache_misses += 1;
 
-        if (LIST_EMPTY(clone))
-            LIST_INSERT_HEAD(clone, kv_clone, entries);
-        else
-            LIST_INSERT_AFTER(last, kv_clone, entries);
+    cache->value = env_lookup_sym(env, symbol);
+    cache->env = cache->value ? env : NULL;
+    cache->version = env_version;
 
-        last = kv_clone;
-    }
+    return cache->value;
+}
 
-    return clone;
+void env_get_cache_stats(size_t *hits, size_t *misses)
+{
+    *hits = cache_hits;
+    *misses = cache_misses;
+}
+
+struct env *env_parent(struct env *env)
+{
+    return env->parent;
+}
+
+int env_set(struct env *env, const char *symbol,
+    struct atom *value)
+{
+    struct symbol *sym = atom_intern(symbol, strlen(symbol));
+    return env_set_(env, sym->name, sym->hash, value, 0);
+}
+
+int env_set_sym(struct env *env, struct atom *symbol,
+    struct atom *value)
+{
+    return env_set_(env, symbol->str.str, symbol->str.hash, value, 0);
+}
+
+void env_bind_sym(struct env *env, struct atom *symbol,
+    struct atom *value)
+{
+    env_set_(env, symbol->str.str, symbol->str.hash, value, 1);
+}
+
+void env_free(struct env *env)
+{
+    gc_remove_root_env(env);
+}
+
+void env_gc_trace(struct env *env)
+{
+    int i, size = env->table_size ? env->table_size : env->count;
+
+    gc_mark(env->parent);
+    gc_mark(env->bindings);
+
+    for (i = 0; i < size; ++i)
+    {
+        gc_mark(env->bindings[i].symbol);
+        gc_mark(env->bindings[i].value);
+    }
 }
 
 #ifdef BUILD_TEST
@@ -161,13 +416,13 @@ TEST(lookup_from_inner_env)
 
     struct atom *atom = env_lookup(inner, "foo");
     ASSERT_TRUE(atom != NULL);
-    ASSERT_EQ(atom1->type, atom->type);
-    ASSERT_EQ(atom1->l, atom->l);
+    ASSERT_EQ(ATOM_TYPE(atom1), ATOM_TYPE(atom));
+    ASSERT_EQ(INT_VAL(atom1), INT_VAL(atom));
 
     atom = env_lookup(inner, "bar");
     ASSERT_TRUE(atom != NULL);
-    ASSERT_EQ(atom2->type, atom->type);
-    ASSERT_EQ(atom2->l, atom->l);
+    ASSERT_EQ(ATOM_TYPE(atom2), ATOM_TYPE(atom));
+    ASSERT_EQ(INT_VAL(atom2), INT_VAL(atom));
 }
 
 TEST(lookup_deeply_nested)
@@ -181,13 +436,13 @@ TEST(lookup_deeply_nested)
 
     struct atom *atom = env_lookup(env, "a");
     ASSERT_TRUE(atom != NULL);
-    ASSERT_EQ(ATOM_INT, atom->type);
-    ASSERT_EQ(1, atom->l);
+    ASSERT_EQ(ATOM_INT, ATOM_TYPE(atom));
+    ASSERT_EQ(1, INT_VAL(atom));
 
     atom = env_lookup(env, "e");
     ASSERT_TRUE(atom != NULL);
-    ASSERT_EQ(ATOM_INT, atom->type);
-    ASSERT_EQ(5, atom->l);
+    ASSERT_EQ(ATOM_INT, ATOM_TYPE(atom));
+    ASSERT_EQ(5, INT_VAL(atom));
 }
 
 TEST(extend)
@@ -200,8 +455,126 @@ TEST(extend)
 
     struct atom *atom = env_lookup(env, "foo");
     ASSERT_TRUE(atom != NULL);
-    ASSERT_EQ(ATOM_INT, atom->type);
-    ASSERT_EQ(2, atom->l);
+    ASSERT_EQ(ATOM_INT, ATOM_TYPE(atom));
+    ASSERT_EQ(2, INT_VAL(atom));
+}
+
+TEST(extend_does_not_copy_outer_bindings)
+{
+    struct env *outer = env_new();
+    struct env *inner = env_extend(outer, 1, "foo", atom_new_int(1));
+
+    // Bindings added to the outer frame later are still visible...
+    env_set(outer, "bar", atom_new_int(2));
+
+    struct atom *atom = env_lookup(inner, "bar");
+    ASSERT_TRUE(atom != NULL);
+    ASSERT_EQ(2, INT_VAL(atom));
+
+    // ...but the inner bindings do not leak outwards.
+    ASSERT_EQ(NULL, env_lookup(outer, "foo"));
+}
+
+TEST(define_shadows_outer_binding)
+{
+    struct env *outer = env_new();
+    env_set(outer, "foo", atom_new_int(1));
+
+    struct env *inner = env_extend(outer, 0);
+    ASSERT_EQ(1, env_set(inner, "foo", atom_new_int(2)));
+
+    ASSERT_EQ(2, INT_VAL(env_lookup(inner, "foo")));
+    ASSERT_EQ(1, INT_VAL(env_lookup(outer, "foo")));
+}
+
+TEST(many_bindings)
+{
+    struct env *env = env_new();
+    char name[16];
+    int i;
+
+    for (i = 0; i < 500; ++i)
+    {
+        snprintf(name, sizeof(name), "sym%d", i);
+        ASSERT_EQ(1, env_set(env, name, atom_new_int(i)));
+    }
+
+    struct env *inner = env_extend(env, 1, "sym7", atom_new_int(-1));
+
+    for (i = 0; i < 500; ++i)
+    {
+        snprintf(name, sizeof(name), "sym%d", i);
+
+        struct atom *atom = env_lookup(env, name);
+        ASSERT_TRUE(atom != NULL);
+        ASSERT_EQ(i, INT_VAL(atom));
+
+        ASSERT_EQ(0, env_set(env, name, atom_new_int(0)));
+    }
+
+    ASSERT_EQ(NULL, env_lookup(env, "sym500"));
+    ASSERT_EQ(-1, INT_VAL(env_lookup(inner, "sym7")));
+    ASSERT_EQ(499, INT_VAL(env_lookup(inner, "sym499")));
+}
+
+TEST(slot_frames)
+{
+    struct env *outer = env_new();
+    struct atom *symbols[2];
+    struct env *frame;
+
+    env_set(outer, "y", atom_new_int(1));
+
+    symbols[0] = atom_new_sym("x", 1);
+    symbols[1] = atom_new_sym("y", 1);
+    frame = env_extend_slots(outer, symbols, 2, NULL, 0);
+
+    // Unbound slots do not hide outer bindings.
+    ASSERT_EQ(NULL, env_lookup(frame, "x"));
+    ASSERT_EQ(1, INT_VAL(env_lookup(frame, "y")));
+
+    *env_slot(frame, 0) = atom_new_int(2);
+    ASSERT_EQ(2, INT_VAL(env_lookup(frame, "x")));
+
+    ASSERT_EQ(1, env_set(frame, "y", atom_new_int(3)));
+    ASSERT_EQ(3, INT_VAL(*env_slot(frame, 1)));
+    ASSERT_EQ(0, env_set(frame, "y", atom_new_int(4)));
+}
+
+TEST(cached_lookup)
+{
+    struct env *outer = env_new();
+    struct env *inner = env_extend(outer, 0);
+    struct atom *foo = atom_new_sym("cached-foo", 10);
+    struct env_cache cache = { NULL, NULL, 0 };
+    struct atom *value;
+    size_t hits, misses, hits_before, misses_before;
+
+    env_get_cache_stats(&hits_before, &misses_before);
+
+    env_set(env_builtins(), "cached-foo", atom_new_int(1));
+    value = env_lookup_cached(outer, foo, &cache);
+    ASSERT_EQ(1, INT_VAL(value));
+    value = env_lookup_cached(outer, foo, &cache);
+    ASSERT_EQ(1, INT_VAL(value));
+
+    // A new binding closer to the start of the lookup shadows the cached
+    // one.
+    env_set(outer, "cached-foo", atom_new_int(2));
+    value = env_lookup_cached(outer, foo, &cache);
+    ASSERT_EQ(2, INT_VAL(value));
+
+    // Bindings in call frames leave the cache valid, and lookups from
+    // them are not cached.
+    env_set(inner, "cached-foo", atom_new_int(3));
+    value = env_lookup_cached(outer, foo, &cache);
+    ASSERT_EQ(2, INT_VAL(value));
+    value = env_lookup_cached(inner, foo, &cache);
+    ASSERT_EQ(3, INT_VAL(value));
+
+    env_get_cache_stats(&hits, &misses);
+    ASSERT_EQ(2, hits - hits_before);
+    ASSERT_EQ(2, misses - misses_before);
 }
 
 TEST(redefine_illegal)
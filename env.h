@@ -1,19 +1,63 @@
 #ifndef ENV_H
 #define ENV_H
 
-#include <sys/queue.h>
-
-struct kv;
-LIST_HEAD(env, kv);
+#include <stddef.h>
 
+struct env;
 struct atom;
 
+// Remembers the result of looking up a symbol from one environment. The
+// result stays valid until env_version changes.
+struct env_cache
+{
+    struct env *env;
+    struct atom *value;
+    unsigned long version;
+};
+
+// Bumped whenever a binding is added to or changed in a top-level
+// environment or the builtins. Call frames do not bump it: their slots
+// are resolved lexically, never through a cache.
+extern unsigned long env_version;
+
+// The environment holding the builtin functions. It encloses every
+// environment created with env_new.
+struct env *env_builtins();
+
 struct env *env_new();
 struct atom *env_lookup(struct env *env, const char *symbol);
+struct atom *env_lookup_sym(struct env *env, struct atom *symbol);
 struct env *env_extend(struct env *env, int count, ...);
+
+// Creates a frame with one binding per symbol, the first value_count of
+// them bound to values and the rest unbound. Binding i stays at slot i,
+// where env_slot finds it without a lookup by name; a NULL slot value
+// means unbound.
+struct env *env_extend_slots(struct env *env, struct atom **symbols,
+    int count, struct atom **values, int value_count);
+struct atom **env_slot(struct env *env, int slot);
+
+// Binds an unbound slot, returning zero if it is already bound.
+int env_define_slot(struct env *env, int slot, struct atom *value);
+
+// Like env_lookup_sym, but answers from the cache when it is still valid
+// for env, and fills it otherwise. Lookups starting from a call frame (as
+// in a lambda compiled on its own) are not cached.
+struct atom *env_lookup_cached(struct env *env, struct atom *symbol,
+    struct env_cache *cache);
+void env_get_cache_stats(size_t *hits, size_t *misses);
+
+struct env *env_parent(struct env *env);
 int env_set(struct env *env, const char *symbol,
     struct atom *value);
+int env_set_sym(struct env *env, struct atom *symbol,
+    struct atom *value);
+
+// Binds symbol in this frame, replacing any existing binding.
+void env_bind_sym(struct env *env, struct atom *symbol,
+    struct atom *value);
 void env_free(struct env *env);
-struct env *env_clone(struct env *env);
+
+void env_gc_trace(struct env *env);
 
 #endif
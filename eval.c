@@ -2,250 +2,713 @@
 #include "atom.h"
 #include "parse.h"
 #include "env.h"
+#include "gc.h"
+#include "vm.h"
+#include "analyze.h"
+#include "scope.h"
+#include "array.h"
+#include "bignum.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-static int atom_cmp(struct atom *a, struct atom *b)
+enum eval_mode eval_mode = EVAL_VM;
+
+struct atom *builtin_quote(struct atom *expr, struct env *env)
 {
-    if (ATOM_TYPE(a) != ATOM_TYPE(b))
-        return 0;
+    struct pair *op = expr->list.first;
+    (void) env;
 
-    if (IS_TRUE(a) && !IS_TRUE(b))
-        return 0;
+    if (!CDR(op))
+    {
+        printf("error: quote takes 1 argument\n");
+        return &nil_atom;
+    }
 
-    if (IS_FALSE(a) && !IS_FALSE(b))
-        return 0;
+    return CAR(CDR(op));
+}
 
-    if (IS_TRUE(b) && !IS_TRUE(a))
-        return 0;
+static struct atom *builtin_atom(struct atom **args, int argc)
+{
+    (void) argc;
 
-    if (IS_FALSE(b) && !IS_FALSE(a))
-        return 0;
+    if (IS_LIST(args[0]))
+        return &false_atom;
+    else
+        return &true_atom;
+}
 
-    if (IS_NIL(a) && !IS_NIL(b))
-        return 0;
+static struct atom *builtin_eq(struct atom **args, int argc)
+{
+    (void) argc;
 
-    if (IS_NIL(b) && !IS_NIL(a))
-        return 0;
+    if (atom_cmp(args[0], args[1]))
+        return &true_atom;
 
-    int result = 1;
+    return &false_atom;
+}
 
-    switch (ATOM_TYPE(a))
+static int division_by_zero(char op, struct atom *b)
+{
+    if ((op == '/' || op == '%') && IS_INT(b) && INT_VAL(b) == 0)
     {
-        case ATOM_INT:
-            if (a->l != b->l)
-                result = 0;
-            break;
+        printf("error: division by zero\n");
+        return 1;
+    }
 
-        case ATOM_STR:
-        case ATOM_SYMBOL:
-            if (strcmp(a->str.str, b->str.str) != 0)
-                result = 0;
-            break;
+    return 0;
+}
 
-        case ATOM_LIST:
-        {
-            struct atom *ai = LIST_FIRST(a->list);
-            struct atom *bi = LIST_FIRST(b->list);
+static int is_number(struct atom *atom)
+{
+    return IS_INT(atom) || IS_FLOAT(atom) || IS_BIGNUM(atom);
+}
 
-            while (ai && bi)
-            {
-                if (!atom_cmp(ai, bi))
-                {
-                    result = 0;
-                    break;
-                }
+static double number_val(struct atom *atom)
+{
+    if (IS_FLOAT(atom))
+        return FLOAT_VAL(atom);
 
-                ai = LIST_NEXT(ai, entries);
-                bi = LIST_NEXT(bi, entries);
-            }
+    if (IS_BIGNUM(atom))
+        return bignum_to_double(atom);
 
-            if (ai != NULL || bi != NULL)
-                result = 0;
+    return INT_VAL(atom);
+}
 
-            break;
+static struct atom *float_arithmetic(char op, double x, double y)
+{
+    switch (op)
+    {
+        case '+': return atom_new_float(x + y);
+        case '-': return atom_new_float(x - y);
+        case '/': return atom_new_float(x / y);
+        case '*': return atom_new_float(x * y);
+    }
+
+    return &nil_atom;
+}
+
+// Arithmetic on two longs that overflows is redone with bignums, as is
+// any arithmetic involving one. If either operand is a double, so is the
+// result.
+
+static struct atom *basic_arithmetic(char op, struct atom *a,
+    struct atom *b)
+{
+    if (IS_INT(a) && IS_INT(b))
+    {
+        long x = INT_VAL(a);
+        long y = INT_VAL(b);
+        long result;
+
+        switch (op)
+        {
+            case '+':
+                if (!__builtin_add_overflow(x, y, &result))
+                    return atom_new_int(result);
+                break;
+
+            case '-':
+                if (!__builtin_sub_overflow(x, y, &result))
+                    return atom_new_int(result);
+                break;
+
+            case '*':
+                if (!__builtin_mul_overflow(x, y, &result))
+                    return atom_new_int(result);
+                break;
+
+            case '/':
+                if (division_by_zero(op, b))
+                    return &nil_atom;
+                if (x != LONG_MIN || y != -1)
+                    return atom_new_int(x / y);
+                break;
         }
+
+        return bignum_arith(op, a, b);
     }
 
-    return result;
+    if (IS_ARRAY(a) || IS_ARRAY(b))
+        return array_arith(op, a, b);
+
+    if (!is_number(a) || !is_number(b))
+    {
+        printf("error: %c works only for numbers\n", op);
+        return &nil_atom;
+    }
+
+    if (IS_FLOAT(a) || IS_FLOAT(b))
+        return float_arithmetic(op, number_val(a), number_val(b));
+
+    if (division_by_zero(op, b))
+        return &nil_atom;
+
+    return bignum_arith(op, a, b);
 }
 
-struct atom *builtin_quote(struct atom *expr, struct env *env)
+static struct atom *builtin_add(struct atom **args, int argc)
 {
-    struct list *list = expr->list;
-    struct atom *op = LIST_FIRST(list);
-    (void) env;
-    return atom_clone(LIST_NEXT(op, entries));
+    (void) argc;
+    return basic_arithmetic('+', args[0], args[1]);
 }
 
-struct atom *builtin_atom(struct atom *expr, struct env *env)
+static struct atom *builtin_sub(struct atom **args, int argc)
 {
-    struct list *list = expr->list;
-    struct atom *op = LIST_FIRST(list);
-    struct atom *a = LIST_NEXT(op, entries);
+    (void) argc;
+    return basic_arithmetic('-', args[0], args[1]);
+}
 
-    (void) env;
+static struct atom *builtin_div(struct atom **args, int argc)
+{
+    (void) argc;
+    return basic_arithmetic('/', args[0], args[1]);
+}
+
+static struct atom *builtin_mul(struct atom **args, int argc)
+{
+    (void) argc;
+    return basic_arithmetic('*', args[0], args[1]);
+}
+
+static struct atom *builtin_gt(struct atom **args, int argc)
+{
+    struct atom *a = args[0];
+    struct atom *b = args[1];
+
+    (void) argc;
+
+    if (IS_ARRAY(a) || IS_ARRAY(b))
+        return array_arith('>', a, b);
+
+    if (!(ATOM_TYPE(a) == ATOM_TYPE(b) && ATOM_TYPE(a) == ATOM_INT))
+    {
+        if (IS_INTEGER(a) && IS_INTEGER(b))
+            return bignum_cmp(a, b) > 0 ? &true_atom : &false_atom;
+
+        if (is_number(a) && is_number(b))
+            return number_val(a) > number_val(b) ? &true_atom : &false_atom;
 
-    if (!a)
         return &nil_atom;
+    }
 
-    if (IS_LIST(a))
-        return &false_atom;
-    else
+    if (INT_VAL(a) > INT_VAL(b))
         return &true_atom;
+
+    return &false_atom;
 }
 
-struct atom *builtin_eq(struct atom *expr, struct env *env)
+static struct atom *builtin_mod(struct atom **args, int argc)
 {
-    struct list *list = expr->list;
-    struct atom *op = LIST_FIRST(list);
-    struct atom *a = CDR(op);
-    struct atom *b = CDR(a);
+    struct atom *a = args[0];
+    struct atom *b = args[1];
+
+    (void) argc;
 
-    if (!a || !b)
+    if (!IS_INTEGER(a) || !IS_INTEGER(b))
     {
-        printf("error: eq takes 2 arguments\n");
+        printf("error: mod arguments must be integers\n");
         return &nil_atom;
     }
 
-    a = eval(a, env);
-    b = eval(b, env);
+    if (division_by_zero('%', b))
+        return &nil_atom;
 
-    if (atom_cmp(a, b))
-        return &true_atom;
+    if (IS_INT(a) && IS_INT(b))
+        return atom_new_int(INT_VAL(b) == -1 ? 0 : INT_VAL(a) % INT_VAL(b));
 
-    return &false_atom;
+    return bignum_arith('%', a, b);
+}
+
+// The list primitives share structure: cons, cdr and the last argument
+// of append reuse the pairs of the lists they are given, and only append
+// and reverse allocate new pairs for the elements they copy.
+
+static int check_list(const char *name, struct atom *list)
+{
+    if (IS_LIST(list) || IS_NIL(list))
+        return 1;
+
+    printf("error: %s: not a list\n", name);
+    return 0;
 }
 
-struct atom *builtin_basic_arithmetic(struct atom *expr, struct env *env)
+static struct atom *new_list(struct pair *first, struct pair *last,
+    int count)
 {
-    struct list *list = expr->list;
-    struct atom *op = LIST_FIRST(list);
-    struct atom *a = CDR(op);
-    struct atom *b = CDR(a);
+    struct atom *list;
+
+    if (!first)
+        return &nil_atom;
+
+    list = atom_new_list_empty();
+    list->list.first = first;
+    list->list.last = last;
+    list->list.count = count;
+
+    return list;
+}
+
+static struct atom *builtin_cons(struct atom **args, int argc)
+{
+    struct atom *list = args[1];
+    struct pair *first;
+
+    (void) argc;
+
+    if (!check_list("cons", list))
+        return &nil_atom;
+
+    first = pair_new(args[0], list->list.first);
 
-    if (!a || !b)
+    return new_list(first, list->list.last ? list->list.last : first,
+        list->list.count + 1);
+}
+
+static struct atom *builtin_car(struct atom **args, int argc)
+{
+    (void) argc;
+
+    if (!IS_LIST(args[0]) || !args[0]->list.first)
     {
-        printf("error: %s takes 2 arguments\n", op->str.str);
+        printf("error: car: not a non-empty list\n");
         return &nil_atom;
     }
 
-    a = eval(a, env);
-    b = eval(b, env);
+    return CAR(args[0]->list.first);
+}
 
-    if (!(ATOM_TYPE(a) == ATOM_TYPE(b) && ATOM_TYPE(a) == ATOM_INT))
+static struct atom *builtin_cdr(struct atom **args, int argc)
+{
+    struct atom *list = args[0];
+
+    (void) argc;
+
+    if (!IS_LIST(list) || !list->list.first)
     {
-        printf("error: %s works only for integers at the moment\n",
-            op->str.str);
+        printf("error: cdr: not a non-empty list\n");
+        return &nil_atom;
+    }
+
+    return new_list(CDR(list->list.first), list->list.last,
+        list->list.count - 1);
+}
+
+static struct atom *builtin_list(struct atom **args, int argc)
+{
+    struct atom *list;
+    int i;
+
+    if (!argc)
+        return &nil_atom;
+
+    list = atom_new_list_empty();
+
+    for (i = 0; i < argc; ++i)
+        atom_list_push(list, args[i]);
+
+    return list;
+}
+
+static struct atom *builtin_null(struct atom **args, int argc)
+{
+    (void) argc;
+
+    if (IS_NIL(args[0]) || (IS_LIST(args[0]) && !args[0]->list.first))
+        return &true_atom;
+
+    return &false_atom;
+}
+
+static struct atom *builtin_length(struct atom **args, int argc)
+{
+    (void) argc;
+
+    if (!check_list("length", args[0]))
         return &nil_atom;
+
+    return atom_new_int(atom_list_length(args[0]));
+}
+
+// Copies the pairs of every list but the last, which becomes the shared
+// tail of the result.
+
+static struct atom *builtin_append(struct atom **args, int argc)
+{
+    struct atom *result;
+    struct list *tail;
+    int i;
+
+    if (!argc)
+        return &nil_atom;
+
+    for (i = 0; i < argc; ++i)
+    {
+        if (!check_list("append", args[i]))
+            return &nil_atom;
+    }
+
+    result = atom_new_list_empty();
+
+    for (i = 0; i < argc - 1; ++i)
+    {
+        struct pair *pair;
+
+        for (pair = args[i]->list.first; pair; pair = pair->cdr)
+            atom_list_push(result, pair->car);
     }
 
-    switch (*op->str.str)
+    if (!result->list.first)
+        return args[argc - 1];
+
+    tail = &args[argc - 1]->list;
+
+    if (tail->first)
     {
-        case '+': return atom_new_int(a->l + b->l);
-        case '-': return atom_new_int(a->l - b->l);
-        case '/': return atom_new_int(a->l / b->l);
-        case '*': return atom_new_int(a->l * b->l);
+        result->list.last->cdr = tail->first;
+        result->list.last = tail->last;
+        result->list.count += tail->count;
     }
 
-    return &nil_atom;
+    return result;
 }
 
-struct atom *builtin_gt(struct atom *expr, struct env *env)
+static struct atom *builtin_reverse(struct atom **args, int argc)
 {
-    struct list *list = expr->list;
-    struct atom *op = LIST_FIRST(list);
-    struct atom *a = CDR(op);
-    struct atom *b = CDR(a);
+    struct atom *list = args[0];
+    struct pair *first = NULL;
+    struct pair *last = NULL;
+    struct pair *pair;
+
+    (void) argc;
 
-    if (!a || !b)
+    if (!check_list("reverse", list))
+        return &nil_atom;
+
+    for (pair = list->list.first; pair; pair = pair->cdr)
     {
-        printf("error: > takes 2 arguments\n");
+        first = pair_new(pair->car, first);
+
+        if (!last)
+            last = first;
+    }
+
+    return new_list(first, last, list->list.count);
+}
+
+static struct atom *builtin_make_vector(struct atom **args, int argc)
+{
+    struct atom *fill = argc > 1 ? args[1] : &nil_atom;
+
+    if (!IS_INT(args[0]) || INT_VAL(args[0]) < 0 ||
+        INT_VAL(args[0]) > INT_MAX)
+    {
+        printf("error: make-vector: invalid length\n");
         return &nil_atom;
     }
 
-    a = eval(a, env);
-    b = eval(b, env);
+    return atom_new_vector(INT_VAL(args[0]), fill);
+}
+
+// Returns the address of element index of vector, or NULL (after
+// printing an error) if either argument is not valid.
 
-    if (!(ATOM_TYPE(a) == ATOM_TYPE(b) && ATOM_TYPE(a) == ATOM_INT))
+static struct atom **vector_item(const char *name, struct atom *vector,
+    struct atom *index)
+{
+    if (!IS_VECTOR(vector))
+    {
+        printf("error: %s: not a vector\n", name);
+        return NULL;
+    }
+
+    if (!IS_INT(index) || INT_VAL(index) < 0 ||
+        INT_VAL(index) >= vector->vector.len)
+    {
+        printf("error: %s: index out of range\n", name);
+        return NULL;
+    }
+
+    return &vector->vector.items[INT_VAL(index)];
+}
+
+static struct atom *builtin_vector_ref(struct atom **args, int argc)
+{
+    struct atom **item = vector_item("vector-ref", args[0], args[1]);
+
+    (void) argc;
+
+    return item ? *item : &nil_atom;
+}
+
+static struct atom *builtin_vector_set(struct atom **args, int argc)
+{
+    struct atom **item = vector_item("vector-set!", args[0], args[1]);
+
+    (void) argc;
+
+    if (!item)
         return &nil_atom;
 
-    if (a->l > b->l)
-        return &true_atom;
+    *item = args[2];
 
-    return &false_atom;
+    return args[2];
 }
 
-struct atom *builtin_if(struct atom *expr, struct env *env)
+static struct atom *builtin_vector_length(struct atom **args, int argc)
 {
-    struct list *list = expr->list;
-    struct atom *op = LIST_FIRST(list);
-    struct atom *predicate = CDR(op);
-    struct atom *true_case = CDR(predicate);
-    struct atom *false_case = CDR(true_case);
+    (void) argc;
 
-    if (!predicate || !true_case || !false_case)
+    if (!IS_VECTOR(args[0]))
     {
-        printf("error: if takes 3 arguments\n");
+        printf("error: vector-length: not a vector\n");
         return &nil_atom;
     }
 
-    predicate = eval(predicate, env);
+    return atom_new_int(args[0]->vector.len);
+}
+
+static struct atom *builtin_vector_to_list(struct atom **args, int argc)
+{
+    (void) argc;
 
-    if (IS_TRUE(predicate))
-        return eval(true_case, env);
+    if (!IS_VECTOR(args[0]))
+    {
+        printf("error: vector->list: not a vector\n");
+        return &nil_atom;
+    }
 
-    return eval(false_case, env);
+    return atom_vector_to_list(args[0]);
 }
 
-struct atom *builtin_mod(struct atom *expr, struct env *env)
+static struct atom *builtin_list_to_vector(struct atom **args, int argc)
 {
-    struct list *list = expr->list;
-    struct atom *op = LIST_FIRST(list);
-    struct atom *a = CDR(op);
-    struct atom *b = CDR(a);
+    (void) argc;
 
-    if (!a || !b)
+    if (!IS_LIST(args[0]) && !IS_NIL(args[0]))
     {
-        printf("error: mod takes two arguments\n");
+        printf("error: list->vector: not a list\n");
         return &nil_atom;
     }
 
-    a = eval(a, env);
-    b = eval(b, env);
+    return atom_vector_from_list(args[0]);
+}
+
+static struct atom *builtin_make_hash(struct atom **args, int argc)
+{
+    (void) args;
+    (void) argc;
+
+    return atom_new_hash();
+}
+
+static int check_hash(const char *name, struct atom *map)
+{
+    if (IS_HASHMAP(map))
+        return 1;
+
+    printf("error: %s: not a hash\n", name);
+    return 0;
+}
+
+// The optional third argument is returned for a missing key.
+
+static struct atom *builtin_hash_ref(struct atom **args, int argc)
+{
+    struct atom *value;
+
+    if (!check_hash("hash-ref", args[0]))
+        return &nil_atom;
+
+    value = atom_hash_ref(args[0], args[1]);
+
+    if (!value)
+        return argc > 2 ? args[2] : &nil_atom;
+
+    return value;
+}
+
+static struct atom *builtin_hash_set(struct atom **args, int argc)
+{
+    (void) argc;
+
+    if (!check_hash("hash-set!", args[0]))
+        return &nil_atom;
+
+    atom_hash_set(args[0], args[1], args[2]);
+
+    return args[2];
+}
+
+static struct atom *builtin_hash_remove(struct atom **args, int argc)
+{
+    (void) argc;
+
+    if (!check_hash("hash-remove!", args[0]))
+        return &nil_atom;
+
+    return atom_hash_remove(args[0], args[1]) ? &true_atom : &false_atom;
+}
+
+static struct atom *builtin_hash_count(struct atom **args, int argc)
+{
+    (void) argc;
+
+    if (!check_hash("hash-count", args[0]))
+        return &nil_atom;
+
+    return atom_new_int(args[0]->hash.count);
+}
+
+static struct atom *builtin_hash_keys(struct atom **args, int argc)
+{
+    (void) argc;
+
+    if (!check_hash("hash-keys", args[0]))
+        return &nil_atom;
+
+    return atom_hash_keys(args[0]);
+}
+
+static struct atom *builtin_make_i64_array(struct atom **args, int argc)
+{
+    return array_make(ARRAY_I64, args[0], argc > 1 ? args[1] : NULL);
+}
+
+static struct atom *builtin_make_f64_array(struct atom **args, int argc)
+{
+    return array_make(ARRAY_F64, args[0], argc > 1 ? args[1] : NULL);
+}
+
+static struct atom *builtin_list_to_i64_array(struct atom **args, int argc)
+{
+    (void) argc;
+    return array_from_list(ARRAY_I64, args[0]);
+}
+
+static struct atom *builtin_list_to_f64_array(struct atom **args, int argc)
+{
+    (void) argc;
+    return array_from_list(ARRAY_F64, args[0]);
+}
+
+static struct atom *builtin_array_to_list(struct atom **args, int argc)
+{
+    (void) argc;
+    return array_to_list(args[0]);
+}
+
+static struct atom *builtin_array_ref(struct atom **args, int argc)
+{
+    (void) argc;
+    return array_ref(args[0], args[1]);
+}
 
-    if (!IS_INT(a) || !IS_INT(b))
+static struct atom *builtin_array_set(struct atom **args, int argc)
+{
+    (void) argc;
+    return array_set(args[0], args[1], args[2]);
+}
+
+static struct atom *builtin_array_length(struct atom **args, int argc)
+{
+    (void) argc;
+
+    if (!IS_ARRAY(args[0]))
     {
-        printf("error: mod arguments must be integers\n");
+        printf("error: array-length: not an array\n");
         return &nil_atom;
     }
 
-    return atom_new_int(a->l % b->l);
+    return atom_new_int(args[0]->array.len);
+}
+
+static struct atom *builtin_sum(struct atom **args, int argc)
+{
+    (void) argc;
+    return array_sum(args[0]);
+}
+
+static struct atom *builtin_min(struct atom **args, int argc)
+{
+    (void) argc;
+    return array_min(args[0]);
+}
+
+static struct atom *builtin_max(struct atom **args, int argc)
+{
+    (void) argc;
+    return array_max(args[0]);
+}
+
+static struct atom *builtin_dot(struct atom **args, int argc)
+{
+    (void) argc;
+    return array_dot(args[0], args[1]);
+}
+
+static struct atom *builtin_scale(struct atom **args, int argc)
+{
+    (void) argc;
+    return array_scale(args[0], args[1]);
+}
+
+// Evaluates the predicate of an if form and returns the branch to be
+// evaluated next, or NULL if the form is malformed.
+
+static struct atom *if_branch(struct atom *expr, struct env *env)
+{
+    struct pair *op = expr->list.first;
+    struct pair *predicate = CDR(op);
+    struct pair *true_case = CDR(predicate);
+    struct pair *false_case = CDR(true_case);
+
+    if (!predicate || !true_case || !false_case)
+    {
+        printf("error: if takes 3 arguments\n");
+        return NULL;
+    }
+
+    if (IS_TRUE(eval_ast(CAR(predicate), env)))
+        return CAR(true_case);
+
+    return CAR(false_case);
+}
+
+struct atom *builtin_if(struct atom *expr, struct env *env)
+{
+    struct atom *branch = if_branch(expr, env);
+
+    if (!branch)
+        return &nil_atom;
+
+    return eval_ast(branch, env);
 }
 
 struct atom *builtin_define(struct atom *expr, struct env *env)
 {
-    struct list *list = expr->list;
-    struct atom *op = LIST_FIRST(list);
-    struct atom *expr_name = CDR(op);
-    struct atom *expr_value = CDR(expr_name);
+    struct pair *op = expr->list.first;
+    struct pair *value = CDDR(op);
+    struct atom *expr_name, *expr_value;
 
-    if (!expr_name || !expr_value)
+    if (!value)
     {
         printf("error: define takes two arguments\n");
         return &nil_atom;
     }
 
+    expr_name = CAR(CDR(op));
+
     if (!IS_SYM(expr_name))
     {
         printf("error: define: first arg must be symbol\n");
         return &nil_atom;
     }
 
-    expr_value = eval(expr_value, env);
+    expr_value = eval_ast(CAR(value), env);
 
-    if (!env_set(env, expr_name->str.str, expr_value))
+    if (!env_set_sym(env, expr_name, expr_value))
     {
         printf("error: cannot redefine %s\n", expr_name->str.str);
         return &nil_atom;
@@ -256,91 +719,191 @@ struct atom *builtin_define(struct atom *expr, struct env *env)
 
 struct atom *builtin_lambda(struct atom *expr, struct env *env)
 {
-    struct list *list = expr->list;
-    struct atom *op = LIST_FIRST(list);
-
-    struct atom *params = CDR(op);
-    struct atom *body = CDR(params);
-
-    if (!params || !body || CDR(body))
-    {
-        printf("error: lambda takes exactly 2 arguments\n");
-        return &nil_atom;
-    }
+    struct pair *op = expr->list.first;
+    const char *error = lambda_syntax_error(op);
 
-    if (!IS_LIST(params) && !IS_NIL(params))
+    if (error)
     {
-        printf("error: first arg to lambda must be a list\n");
+        printf("error: %s\n", error);
         return &nil_atom;
     }
 
-    return atom_new_closure(params, body, env);
+    return atom_new_closure(CAR(CDR(op)), CAR(CDDR(op)), env);
 }
 
-typedef struct atom *(*builtin_function_t)(struct atom *, struct env *);
+static const struct primitive builtin_primitives[] = {
+    { "atom", &builtin_atom, 1, 1 },
+    { "eq", &builtin_eq, 2, 2 },
+    { "+", &builtin_add, 2, 2 },
+    { "-", &builtin_sub, 2, 2 },
+    { "/", &builtin_div, 2, 2 },
+    { "*", &builtin_mul, 2, 2 },
+    { ">", &builtin_gt, 2, 2 },
+    { "mod", &builtin_mod, 2, 2 },
+    { "cons", &builtin_cons, 2, 2 },
+    { "car", &builtin_car, 1, 1 },
+    { "cdr", &builtin_cdr, 1, 1 },
+    { "list", &builtin_list, 0, -1 },
+    { "null?", &builtin_null, 1, 1 },
+    { "length", &builtin_length, 1, 1 },
+    { "append", &builtin_append, 0, -1 },
+    { "reverse", &builtin_reverse, 1, 1 },
+    { "make-vector", &builtin_make_vector, 1, 2 },
+    { "vector-ref", &builtin_vector_ref, 2, 2 },
+    { "vector-set!", &builtin_vector_set, 3, 3 },
+    { "vector-length", &builtin_vector_length, 1, 1 },
+    { "vector->list", &builtin_vector_to_list, 1, 1 },
+    { "list->vector", &builtin_list_to_vector, 1, 1 },
+    { "make-hash", &builtin_make_hash, 0, 0 },
+    { "hash-ref", &builtin_hash_ref, 2, 3 },
+    { "hash-set!", &builtin_hash_set, 3, 3 },
+    { "hash-remove!", &builtin_hash_remove, 2, 2 },
+    { "hash-count", &builtin_hash_count, 1, 1 },
+    { "hash-keys", &builtin_hash_keys, 1, 1 },
+    { "make-i64-array", &builtin_make_i64_array, 1, 2 },
+    { "make-f64-array", &builtin_make_f64_array, 1, 2 },
+    { "list->i64-array", &builtin_list_to_i64_array, 1, 1 },
+    { "list->f64-array", &builtin_list_to_f64_array, 1, 1 },
+    { "array->list", &builtin_array_to_list, 1, 1 },
+    { "array-ref", &builtin_array_ref, 2, 2 },
+    { "array-set!", &builtin_array_set, 3, 3 },
+    { "array-length", &builtin_array_length, 1, 1 },
+    { "sum", &builtin_sum, 1, 1 },
+    { "min", &builtin_min, 1, 1 },
+    { "max", &builtin_max, 1, 1 },
+    { "dot", &builtin_dot, 2, 2 },
+    { "scale", &builtin_scale, 2, 2 },
+
+    { NULL, NULL, 0, 0 }
+};
 
-static struct builtin_function_def
+static const struct special_form_def
 {
     const char *name;
-    builtin_function_t fn;
-} builtin_function_defs[] = {
+    special_form_t fn;
+} special_form_defs[] = {
     { "quote", &builtin_quote },
-    { "atom", &builtin_atom },
-    { "eq", &builtin_eq },
-    { "+", &builtin_basic_arithmetic },
-    { "-", &builtin_basic_arithmetic },
-    { "/", &builtin_basic_arithmetic },
-    { "*", &builtin_basic_arithmetic },
-    { ">", &builtin_gt },
     { "if", &builtin_if },
-    { "mod", &builtin_mod },
     { "define", &builtin_define },
     { "lambda", &builtin_lambda },
 
     { NULL, NULL }
 };
 
-struct atom *eval_closure(struct atom *closure, struct atom *args,
-    struct env *env)
+// Primitives are ordinary values bound in the builtins environment, which
+// encloses every environment made by env_new. Special forms are not
+// values; eval finds them through the special field of their symbol.
+
+__attribute__((constructor))
+static void setup_builtins()
 {
-    struct env *closure_env = closure->closure.env;
+    const struct special_form_def *def;
+    const struct primitive *primitive;
 
-    struct atom *param_value = args;
-    struct atom *param_name = CAR(closure->closure.params->list);
+    for (def = special_form_defs; def->name; ++def)
+    {
+        struct symbol *symbol = atom_intern(def->name, strlen(def->name));
+        symbol->special = def->fn;
+        gc_add_root(symbol);
+    }
 
-    while (param_value && param_name)
+    for (primitive = builtin_primitives; primitive->name; ++primitive)
     {
-        struct atom *evaluated_param = eval(param_value, env);
+        env_set(env_builtins(), primitive->name,
+            atom_new_primitive(primitive));
+    }
+}
 
-        closure_env = env_extend(closure_env, 1,
-            param_name->str.str, evaluated_param);
+__attribute__((constructor))
+static void setup_eval_mode()
+{
+    const char *mode = getenv("LISPISH_EVAL");
+
+    if (mode && strcmp(mode, "ast") == 0)
+        eval_mode = EVAL_AST;
+    else if (mode && strcmp(mode, "analyze") == 0)
+        eval_mode = EVAL_ANALYZE;
+    else if (mode && strcmp(mode, "vm") == 0)
+        eval_mode = EVAL_VM;
+}
 
-        param_value = CDR(param_value);
-        param_name = CDR(param_name);
+int eval_check_arity(const struct primitive *primitive, int argc)
+{
+    if (argc >= primitive->min_args &&
+        (primitive->max_args < 0 || argc <= primitive->max_args))
+    {
+        return 1;
     }
 
-    if (param_value && !param_name)
+    if (primitive->min_args == primitive->max_args)
+        printf("error: %s takes %d arguments\n", primitive->name,
+            primitive->min_args);
+    else
+        printf("error: incorrect number of arguments to %s\n",
+            primitive->name);
+
+    return 0;
+}
+
+static struct atom *eval_primitive(const struct primitive *primitive,
+    struct pair *args, int argc, struct env *env)
+{
+    struct pair *arg;
+
+    if (!eval_check_arity(primitive, argc))
+        return &nil_atom;
+
+    struct atom *values[argc + 1];
+
+    for (argc = 0, arg = args; arg; arg = CDR(arg))
+        values[argc++] = eval_ast(CAR(arg), env);
+
+    return primitive->fn(values, argc);
+}
+
+// Creates the frame for a call to closure, binding the parameters to the
+// evaluated args. The number of arguments is checked before any of them
+// is evaluated; NULL is returned if it is wrong.
+
+static struct env *eval_closure_env(struct atom *closure, struct pair *args,
+    int argc, struct env *env)
+{
+    struct atom *params = closure->closure.params;
+    struct pair *param = params->list.first;
+    struct pair *arg;
+    int count = atom_list_length(params);
+
+    if (argc != count)
     {
         printf("error: incorrect number of arguments\n");
-        return &nil_atom;
+        return NULL;
     }
 
-    if (!param_value && param_name)
+    struct atom *symbols[count + 1];
+    struct atom *values[count + 1];
+
+    for (argc = 0, arg = args; arg; arg = CDR(arg), param = CDR(param))
     {
-        printf("error: incorrect number of arguments\n");
-        return &nil_atom;
+        symbols[argc] = CAR(param);
+        values[argc++] = eval_ast(CAR(arg), env);
     }
 
-    return eval(closure->closure.body, closure_env);
+    return env_extend_slots(closure->closure.env, symbols, count, values,
+        count);
 }
 
-struct atom *eval(struct atom *expr, struct env *env)
+// The bodies of closures and the branches of if are evaluated by looping
+// instead of recursing, so tail calls run in constant C stack.
+
+struct atom *eval_ast(struct atom *expr, struct env *env)
 {
+tail_call:
+
     // symbols and not-a-lists are evaluated or returned directly
 
     if (IS_SYM(expr))
     {
-        struct atom *atom = env_lookup(env, expr->str.str);
+        struct atom *atom = env_lookup_sym(env, expr);
 
         if (atom)
         {
@@ -357,57 +920,83 @@ struct atom *eval(struct atom *expr, struct env *env)
     if (!IS_LIST(expr))
         return expr;
 
-    struct list *list = expr->list;
-    struct atom *op = LIST_FIRST(list);
+    struct pair *args = CDR(expr->list.first);
+    int argc = expr->list.count - 1;
+    struct atom *op = CAR(expr->list.first);
+    struct atom *fn = op;
 
-    // Check if the first elem is not a symbol or a closure. If it's
-    // not, then we'll evaluate it (it could be a lambda form).
-
-    if (!IS_SYM(op) && !IS_CLOSURE(op))
-    {
-        struct atom *evaluated_op = eval(op, env);
-        // Replace the evaluated one to the list!
-        LIST_REMOVE(op, entries);
-        LIST_INSERT_HEAD(list, evaluated_op, entries);
-        op = evaluated_op;
-    }
-
-    // If the first elem is a symbol, it should be a name for a builtin
-    // function or a closure bound to that name by the user. If the
-    // first argument is directly a closure, eval that with the args.
+    // If the first elem is a symbol, it names either a special form or
+    // a function bound in the environment (a primitive or a closure).
+    // Anything else but a function is evaluated (it could be a lambda
+    // form). The form itself is left untouched, so that it evaluates
+    // the same way every time.
 
     if (IS_SYM(op))
     {
-        struct builtin_function_def *def = builtin_function_defs;
-        while (def->name && def->fn)
+        special_form_t special = SYMBOL(op)->special;
+
+        if (special == &builtin_if)
         {
-            if (strcmp(op->str.str, def->name) == 0)
-            {
-                return def->fn(expr, env);
-            }
+            expr = if_branch(expr, env);
 
-            ++def;
+            if (!expr)
+                return &nil_atom;
+
+            goto tail_call;
         }
 
-        struct atom *closure = env_lookup(env, op->str.str);
+        if (special)
+            return special(expr, env);
+
+        fn = env_lookup_sym(env, op);
 
-        if (closure)
+        if (!fn)
         {
-            return eval_closure(closure, CDR(op), env);
+            printf("error: unknown function %s\n", op->str.str);
+            return &nil_atom;
         }
-
-        printf("error: unknown function %s\n", op->str.str);
     }
-    else if (IS_CLOSURE(op))
+    else if (!IS_CLOSURE(op) && !IS_PRIMITIVE(op))
     {
-        return eval_closure(op, CDR(op), env);
+        fn = eval_ast(op, env);
     }
 
+    if (IS_CLOSURE(fn))
+    {
+        env = eval_closure_env(fn, args, argc, env);
+
+        if (!env)
+            return &nil_atom;
+
+        expr = fn->closure.body;
+        goto tail_call;
+    }
+
+    if (IS_PRIMITIVE(fn))
+        return eval_primitive(fn->primitive, args, argc, env);
+
     printf("error: cannot evaluate\n");
 
     return &nil_atom;
 }
 
+struct atom *eval(struct atom *expr, struct env *env)
+{
+    switch (eval_mode)
+    {
+    case EVAL_AST:
+        return eval_ast(expr, env);
+
+    case EVAL_ANALYZE:
+        return analyze_eval(expr, env);
+
+    case EVAL_VM:
+        break;
+    }
+
+    return vm_eval(expr, env);
+}
+
 struct atom *eval_str(const char *expr, struct env *env)
 {
     struct atom *result;
@@ -437,7 +1026,7 @@ TEST(basic_if)
     print_atom(result, 0);
     ASSERT_TRUE(result != NULL);
     ASSERT_EQ(ATOM_INT, ATOM_TYPE(result));
-    ASSERT_EQ(42, result->l);
+    ASSERT_EQ(42, INT_VAL(result));
 }
 
 TEST(if_with_sub_expressions)
@@ -446,7 +1035,7 @@ TEST(if_with_sub_expressions)
     struct atom *result = eval_str("(if (> 1 2) (- 1000 1) (+ 40 (- 3 1)))", env);
     ASSERT_TRUE(result != NULL);
     ASSERT_EQ(ATOM_INT, ATOM_TYPE(result));
-    ASSERT_EQ(42, result->l);
+    ASSERT_EQ(42, INT_VAL(result));
 }
 
 TEST(evaluate_symbol)
@@ -458,7 +1047,7 @@ TEST(evaluate_symbol)
 
     ASSERT_TRUE(result != NULL);
     ASSERT_EQ(ATOM_INT, ATOM_TYPE(result));
-    ASSERT_EQ(42, result->l);
+    ASSERT_EQ(42, INT_VAL(result));
 }
 
 TEST(evaluate_missing_symbol)
@@ -482,8 +1071,8 @@ TEST(define)
     struct atom *atom = env_lookup(env, "x");
 
     ASSERT_TRUE(atom != NULL);
-    ASSERT_EQ(ATOM_INT, atom->type);
-    ASSERT_EQ(100, atom->l);
+    ASSERT_EQ(ATOM_INT, ATOM_TYPE(atom));
+    ASSERT_EQ(100, INT_VAL(atom));
 }
 
 TEST(define_missing_value)
@@ -518,8 +1107,8 @@ TEST(define_with_val_as_expr)
     struct atom *atom = env_lookup(env, "x");
 
     ASSERT_TRUE(atom != NULL);
-    ASSERT_EQ(ATOM_INT, atom->type);
-    ASSERT_EQ(9, atom->l);
+    ASSERT_EQ(ATOM_INT, ATOM_TYPE(atom));
+    ASSERT_EQ(9, INT_VAL(atom));
 }
 
 TEST(lambda_evaluates_to_closure)
@@ -561,16 +1150,16 @@ TEST(lambda_closure_holds_function)
 
     ASSERT_TRUE(IS_LIST(params));
 
-    ASSERT_TRUE(IS_SYM(CAR(params->list)));
-    ASSERT_STREQ("x", CAR(params->list)->str.str);
+    ASSERT_TRUE(IS_SYM(CAR(params->list.first)));
+    ASSERT_STREQ("x", CAR(params->list.first)->str.str);
 
-    ASSERT_TRUE(IS_SYM(CDR(CAR(params->list))));
-    ASSERT_STREQ("y", CDR(CAR(params->list))->str.str);
+    ASSERT_TRUE(IS_SYM(CAR(CDR(params->list.first))));
+    ASSERT_STREQ("y", CAR(CDR(params->list.first))->str.str);
 
     ASSERT_TRUE(IS_LIST(body));
 
-    ASSERT_TRUE(IS_SYM(CAR(body->list)));
-    ASSERT_STREQ("+", CAR(body->list)->str.str);
+    ASSERT_TRUE(IS_SYM(CAR(body->list.first)));
+    ASSERT_STREQ("+", CAR(body->list.first)->str.str);
 }
 
 TEST(lambda_args_are_lists)
@@ -601,15 +1190,14 @@ TEST(evaluating_call_to_closure)
 
     struct atom *closure = eval_str("(lambda () (+ 1 2))", env);
 
-    struct atom *list = atom_new_list_empty();
-    LIST_INSERT_HEAD(list->list, closure, entries);
+    struct atom *list = atom_new_list(pair_new(closure, NULL));
 
     struct env *env2 = env_new();
     struct atom *result = eval(list, env2);
 
     ASSERT_TRUE(result != NULL);
     ASSERT_TRUE(IS_INT(result));
-    ASSERT_EQ(3, result->l);
+    ASSERT_EQ(3, INT_VAL(result));
 }
 
 TEST(evaluating_call_to_closure_with_args)
@@ -618,18 +1206,14 @@ TEST(evaluating_call_to_closure_with_args)
 
     struct atom *closure = eval_str("(lambda (a b) (+ a b))", env);
 
-    struct atom *list = atom_new_list_empty();
-    LIST_INSERT_HEAD(list->list, closure, entries);
-    struct atom *a = atom_new_int(4);
-    struct atom *b = atom_new_int(5);
-    LIST_INSERT_AFTER(closure, a, entries);
-    LIST_INSERT_AFTER(a, b, entries);
+    struct atom *list = atom_list_append(atom_new_list_empty(), 3,
+        closure, atom_new_int(4), atom_new_int(5));
 
     struct atom *result = eval(list, env);
 
     ASSERT_TRUE(result != NULL);
     ASSERT_TRUE(IS_INT(result));
-    ASSERT_EQ(9, result->l);
+    ASSERT_EQ(9, INT_VAL(result));
 }
 
 TEST(call_to_function_should_eval_args)
@@ -648,7 +1232,7 @@ TEST(call_to_function_should_eval_args)
     ASSERT_TRUE(result != NULL);
     ASSERT_FALSE(IS_NIL(result));
     ASSERT_TRUE(IS_INT(result));
-    ASSERT_EQ(25, result->l);
+    ASSERT_EQ(25, INT_VAL(result));
 }
 
 TEST(evaluating_call_to_closure_with_free_vars)
@@ -668,7 +1252,7 @@ TEST(evaluating_call_to_closure_with_free_vars)
 
     ASSERT_TRUE(result != NULL);
     ASSERT_TRUE(IS_INT(result));
-    ASSERT_EQ(1, result->l);
+    ASSERT_EQ(1, INT_VAL(result));
 }
 
 TEST(calling_very_simple_func_in_env)
@@ -679,7 +1263,7 @@ TEST(calling_very_simple_func_in_env)
 
     struct atom *result = eval_str("(add 1 2)", env);
     ASSERT_TRUE(IS_INT(result));
-    ASSERT_EQ(3, result->l);
+    ASSERT_EQ(3, INT_VAL(result));
 }
 
 TEST(calling_lambda_directly)
@@ -689,7 +1273,7 @@ TEST(calling_lambda_directly)
     struct atom *result = eval(a, env_new());
     ASSERT_TRUE(result != NULL);
     ASSERT_TRUE(IS_INT(result));
-    ASSERT_EQ(42, result->l);
+    ASSERT_EQ(42, INT_VAL(result));
 }
 
 TEST(calling_complex_expression_which_evaluates_to_function)
@@ -701,7 +1285,48 @@ TEST(calling_complex_expression_which_evaluates_to_function)
 
     ASSERT_TRUE(result != NULL);
     ASSERT_TRUE(IS_INT(result));
-    ASSERT_EQ(5, result->l);
+    ASSERT_EQ(5, INT_VAL(result));
+}
+
+TEST(evaluation_does_not_modify_code)
+{
+    struct env *env = env_new();
+    int pos = 0;
+    struct atom *expr = parse("((if flag + -) 5 3)", &pos);
+    struct atom *result;
+
+    env_set(env, "flag", &true_atom);
+    result = eval_ast(expr, env);
+    ASSERT_EQ(8, INT_VAL(result));
+    ASSERT_TRUE(IS_LIST(CAR(expr->list.first)));
+
+    env_bind_sym(env, atom_new_sym("flag", 4), &false_atom);
+    result = eval_ast(expr, env);
+    ASSERT_EQ(2, INT_VAL(result));
+}
+
+TEST(builtins_are_values)
+{
+    struct env *env = env_new();
+
+    struct atom *result = eval_str("((if #t + -) 40 2)", env);
+    ASSERT_TRUE(IS_INT(result));
+    ASSERT_EQ(42, INT_VAL(result));
+
+    eval_str("(define plus +)", env);
+    result = eval_str("(plus 1 2)", env);
+    ASSERT_TRUE(IS_INT(result));
+    ASSERT_EQ(3, INT_VAL(result));
+
+    result = eval_str("((lambda (+) (+ 1 2)) -)", env);
+    ASSERT_TRUE(IS_INT(result));
+    ASSERT_EQ(-1, INT_VAL(result));
+
+    result = eval_str("(+ 1)", env);
+    ASSERT_TRUE(IS_NIL(result));
+
+    ASSERT_TRUE(IS_PRIMITIVE(env_lookup(env, "mod")));
+    ASSERT_TRUE(env_lookup(env, "if") == NULL);
 }
 
 TEST(calling_atom_fails)
@@ -722,7 +1347,7 @@ TEST(make_sure_args_to_func_are_evaluated)
     struct atom *result = eval_str("((lambda (x) x) (+ 1 2))", env);
     ASSERT_TRUE(result != NULL);
     ASSERT_TRUE(IS_INT(result));
-    ASSERT_EQ(3, result->l);
+    ASSERT_EQ(3, INT_VAL(result));
 }
 
 TEST(calling_with_wrong_number_of_args)
@@ -746,12 +1371,12 @@ TEST(calling_function_recursively)
     struct atom *result = eval_str("(fn 0)", env);
     ASSERT_TRUE(result != NULL);
     ASSERT_TRUE(IS_INT(result));
-    ASSERT_EQ(42, result->l);
+    ASSERT_EQ(42, INT_VAL(result));
 
     result = eval_str("(fn 10)", env);
     ASSERT_TRUE(result != NULL);
     ASSERT_TRUE(IS_INT(result));
-    ASSERT_EQ(42, result->l);
+    ASSERT_EQ(42, INT_VAL(result));
 }
 
 TEST(fibonacci)
@@ -776,7 +1401,7 @@ TEST(fibonacci)
 #define ASSERT_INT_VAL(ATOM, VALUE) \
     ASSERT_TRUE((ATOM) != NULL); \
     ASSERT_TRUE(IS_INT(ATOM)); \
-    ASSERT_EQ((VALUE), (ATOM)->l)
+    ASSERT_EQ((VALUE), INT_VAL(ATOM))
 
     result = eval_str("(fibonacci 0)", env);
     ASSERT_INT_VAL(result, 0);
@@ -803,4 +1428,428 @@ TEST(fibonacci)
     ASSERT_INT_VAL(result, 13);
 }
 
+TEST(vectors)
+{
+    struct env *env = env_new();
+    struct atom *result;
+
+    eval_str("(define v (make-vector 3 0))", env);
+    ASSERT_TRUE(IS_VECTOR(env_lookup(env, "v")));
+    ASSERT_INT_VAL(eval_str("(vector-length v)", env), 3);
+    ASSERT_INT_VAL(eval_str("(vector-ref v 2)", env), 0);
+
+    eval_str("(vector-set! v 0 (quote (a b)))", env);
+    eval_str("(vector-set! v 2 42)", env);
+    ASSERT_INT_VAL(eval_str("(vector-ref v 2)", env), 42);
+    ASSERT_TRUE(IS_LIST(eval_str("(vector-ref v 0)", env)));
+
+    ASSERT_TRUE(IS_NIL(eval_str("(vector-ref v 3)", env)));
+    ASSERT_TRUE(IS_NIL(eval_str("(vector-ref v -1)", env)));
+    ASSERT_TRUE(IS_NIL(eval_str("(vector-ref 1 0)", env)));
+    ASSERT_TRUE(IS_NIL(eval_str("(make-vector -1)", env)));
+
+    result = eval_str("(vector->list v)", env);
+    ASSERT_TRUE(IS_LIST(result));
+    ASSERT_EQ(3, atom_list_length(result));
+
+    // The elements can go into more than one list.
+    eval_str("(vector->list v)", env);
+    ASSERT_EQ(3, atom_list_length(result));
+
+    result = eval_str("(list->vector (vector->list v))", env);
+    ASSERT_TRUE(atom_cmp(result, env_lookup(env, "v")));
+
+    ASSERT_TRUE(IS_TRUE(eval_str("(eq #(1 \"a\" (b)) (list->vector "
+        "(quote (1 \"a\" (b)))))", env)));
+    ASSERT_TRUE(IS_FALSE(eval_str("(eq #(1 2) #(1 2 3))", env)));
+    ASSERT_TRUE(IS_NIL(eval_str("(vector->list #())", env)));
+    ASSERT_INT_VAL(eval_str("(vector-length (list->vector (quote ())))",
+        env), 0);
+}
+
+TEST(list_primitives)
+{
+    struct env *env = env_new();
+    struct atom *list, *result;
+
+    list = eval_str("(define l (list 1 (quote two) \"three\"))", env);
+    ASSERT_TRUE(IS_LIST(list));
+    ASSERT_INT_VAL(eval_str("(length l)", env), 3);
+    ASSERT_INT_VAL(eval_str("(car l)", env), 1);
+    ASSERT_TRUE(IS_SYM(eval_str("(car (cdr l))", env)));
+
+    // cdr and cons share the pairs of the list they are given.
+    result = eval_str("(cdr l)", env);
+    ASSERT_TRUE(result->list.first == list->list.first->cdr);
+    ASSERT_TRUE(result->list.last == list->list.last);
+    ASSERT_EQ(2, result->list.count);
+
+    result = eval_str("(cons 0 l)", env);
+    ASSERT_TRUE(result->list.first->cdr == list->list.first);
+    ASSERT_TRUE(result->list.last == list->list.last);
+    ASSERT_EQ(4, result->list.count);
+
+    result = eval_str("(cons 0 (list))", env);
+    ASSERT_TRUE(result->list.last == result->list.first);
+
+    result = eval_str("(reverse l)", env);
+    ASSERT_EQ(1, INT_VAL(CAR(result->list.last)));
+    ASSERT_INT_VAL(eval_str("(length (cons 0 l))", env), 4);
+
+    ASSERT_TRUE(IS_NIL(eval_str("(cdr (cdr (cdr l)))", env)));
+    ASSERT_TRUE(IS_TRUE(eval_str("(null? (cdr (cdr (cdr l))))", env)));
+    ASSERT_TRUE(IS_FALSE(eval_str("(null? l)", env)));
+    ASSERT_TRUE(IS_NIL(eval_str("(list)", env)));
+    ASSERT_INT_VAL(eval_str("(car (cons 5 (list)))", env), 5);
+
+    result = eval_str("(append (list 1 2) (quote ()) l)", env);
+    ASSERT_EQ(5, atom_list_length(result));
+    ASSERT_TRUE(result->list.first->cdr->cdr == list->list.first);
+    ASSERT_TRUE(result->list.last == list->list.last);
+
+    result = eval_str("(append (list 1 2) (list))", env);
+    ASSERT_EQ(2, atom_list_length(result));
+    ASSERT_EQ(2, INT_VAL(CAR(result->list.last)));
+    ASSERT_TRUE(IS_TRUE(eval_str("(eq (append (list 1) (list 2 3)) "
+        "(quote (1 2 3)))", env)));
+    ASSERT_TRUE(IS_NIL(eval_str("(append)", env)));
+    ASSERT_TRUE(eval_str("(append (list) l)", env) == list);
+
+    ASSERT_TRUE(IS_TRUE(eval_str("(eq (reverse (list 1 2 3)) "
+        "(quote (3 2 1)))", env)));
+    ASSERT_TRUE(IS_NIL(eval_str("(reverse (quote ()))", env)));
+
+    ASSERT_TRUE(IS_NIL(eval_str("(car (list))", env)));
+    ASSERT_TRUE(IS_NIL(eval_str("(cdr 1)", env)));
+    ASSERT_TRUE(IS_NIL(eval_str("(cons 1 2)", env)));
+    ASSERT_TRUE(IS_NIL(eval_str("(length 1)", env)));
+}
+
+TEST(quoted_data_is_not_copied)
+{
+    struct env *env = env_new();
+    struct atom *first;
+
+    eval_str("(define q (lambda () (quote (1 (2)))))", env);
+    first = eval_str("(q)", env);
+
+    ASSERT_TRUE(IS_LIST(first));
+    ASSERT_TRUE(eval_str("(q)", env) == first);
+}
+
+TEST(hashes)
+{
+    struct env *env = env_new();
+    struct atom *result;
+
+    eval_str("(define h (make-hash))", env);
+    eval_str("(hash-set! h 1 (quote one))", env);
+    eval_str("(hash-set! h \"two\" 2)", env);
+    eval_str("(hash-set! h (quote three) 3)", env);
+    eval_str("(hash-set! h (quote (4 (four))) 4)", env);
+    ASSERT_INT_VAL(eval_str("(hash-count h)", env), 4);
+
+    ASSERT_TRUE(IS_SYM(eval_str("(hash-ref h 1)", env)));
+    ASSERT_INT_VAL(eval_str("(hash-ref h \"two\")", env), 2);
+    ASSERT_INT_VAL(eval_str("(hash-ref h (quote three))", env), 3);
+    ASSERT_INT_VAL(eval_str("(hash-ref h (quote (4 (four))))", env), 4);
+    ASSERT_TRUE(IS_NIL(eval_str("(hash-ref h 5)", env)));
+    ASSERT_INT_VAL(eval_str("(hash-ref h 5 0)", env), 0);
+
+    eval_str("(hash-set! h \"two\" 22)", env);
+    ASSERT_INT_VAL(eval_str("(hash-ref h \"two\")", env), 22);
+    ASSERT_INT_VAL(eval_str("(hash-count h)", env), 4);
+
+    result = eval_str("(hash-remove! h 1)", env);
+    ASSERT_TRUE(IS_TRUE(result));
+    result = eval_str("(hash-remove! h 1)", env);
+    ASSERT_TRUE(IS_FALSE(result));
+    ASSERT_INT_VAL(eval_str("(hash-count h)", env), 3);
+    ASSERT_EQ(3, atom_list_length(eval_str("(hash-keys h)", env)));
+
+    ASSERT_TRUE(IS_NIL(eval_str("(hash-ref 1 1)", env)));
+    ASSERT_TRUE(IS_NIL(eval_str("(hash-keys (make-hash))", env)));
+}
+
+TEST(hash_grows_and_shrinks)
+{
+    struct atom *map = atom_new_hash();
+    long i;
+
+    for (i = 0; i < 1000; ++i)
+        atom_hash_set(map, atom_new_int(i), atom_new_int(i * i));
+
+    ASSERT_EQ(1000, map->hash.count);
+
+    // Removing entries must not hide the ones after them.
+    for (i = 0; i < 1000; i += 2)
+        ASSERT_TRUE(atom_hash_remove(map, atom_new_int(i)));
+
+    ASSERT_EQ(500, map->hash.count);
+
+    for (i = 0; i < 1000; ++i)
+    {
+        struct atom *value = atom_hash_ref(map, atom_new_int(i));
+
+        if (i % 2)
+            ASSERT_EQ(i * i, INT_VAL(value));
+        else
+            ASSERT_EQ(NULL, value);
+    }
+
+    ASSERT_EQ(atom_hash(atom_new_int(7)), atom_hash(atom_box(atom_new_int(7))));
+    ASSERT_EQ(atom_hash(atom_new_str("abc", 3)),
+        atom_hash(atom_new_str("abc", 3)));
+}
+
+TEST(numeric_arrays)
+{
+    struct env *env = env_new();
+    struct atom *result;
+
+    eval_str("(define a (list->i64-array (quote (1 2 3 4 5))))", env);
+    eval_str("(define b (make-i64-array 5 10))", env);
+    eval_str("(define f (list->f64-array (quote (1 2 3 4 5))))", env);
+
+    ASSERT_INT_VAL(eval_str("(array-length a)", env), 5);
+    ASSERT_INT_VAL(eval_str("(sum a)", env), 15);
+    ASSERT_INT_VAL(eval_str("(sum (+ a b))", env), 65);
+    ASSERT_INT_VAL(eval_str("(sum (* a 2))", env), 30);
+    ASSERT_INT_VAL(eval_str("(sum (- 0 a))", env), -15);
+    ASSERT_INT_VAL(eval_str("(sum (/ b a))", env), 10 + 5 + 3 + 2 + 2);
+    ASSERT_INT_VAL(eval_str("(sum (> a 2))", env), 3);
+    ASSERT_INT_VAL(eval_str("(dot a a)", env), 55);
+    ASSERT_INT_VAL(eval_str("(min (scale a (- 0 1)))", env), -5);
+    ASSERT_INT_VAL(eval_str("(max a)", env), 5);
+
+    result = eval_str("(sum (/ f 2))", env);
+    ASSERT_TRUE(IS_FLOAT(result));
+    ASSERT_TRUE(FLOAT_VAL(result) == 7.5);
+
+    result = eval_str("(dot a f)", env);
+    ASSERT_TRUE(IS_FLOAT(result));
+    ASSERT_TRUE(FLOAT_VAL(result) == 55);
+
+    result = eval_str("(array-ref (+ a f) 4)", env);
+    ASSERT_TRUE(IS_FLOAT(result));
+    ASSERT_TRUE(FLOAT_VAL(result) == 10);
+
+    eval_str("(array-set! a 0 100)", env);
+    ASSERT_INT_VAL(eval_str("(array-ref a 0)", env), 100);
+    ASSERT_EQ(5, atom_list_length(eval_str("(array->list a)", env)));
+
+    ASSERT_TRUE(IS_NIL(eval_str("(array-ref a 5)", env)));
+    ASSERT_TRUE(IS_NIL(eval_str("(+ a (make-i64-array 4))", env)));
+    ASSERT_TRUE(IS_NIL(eval_str("(/ a (make-i64-array 5))", env)));
+    ASSERT_TRUE(IS_NIL(eval_str("(min (make-f64-array 0))", env)));
+    ASSERT_TRUE(IS_NIL(eval_str("(sum 1)", env)));
+}
+
+TEST(integers_overflow_into_bignums)
+{
+    struct env *env = env_new();
+    struct atom *result;
+
+    eval_str("(define fact (lambda (n) (if (eq n 0) 1 (* n (fact (- n 1))))))",
+        env);
+
+    result = eval_str("(fact 25)", env);
+    ASSERT_TRUE(IS_BIGNUM(result));
+    ASSERT_TRUE(IS_TRUE(eval_str(
+        "(eq (fact 25) 15511210043330985984000000)", env)));
+
+    result = eval_str("(/ (fact 25) (fact 23))", env);
+    ASSERT_INT_VAL(result, 600);
+
+    result = eval_str("(mod (+ (fact 30) 7) (fact 20))", env);
+    ASSERT_INT_VAL(result, 7);
+
+    result = eval_str("(- (+ 9223372036854775807 1) 1)", env);
+    ASSERT_INT_VAL(result, LONG_MAX);
+
+    result = eval_str("(> 100000000000000000000 9223372036854775807)", env);
+    ASSERT_TRUE(IS_TRUE(result));
+
+    result = eval_str("(> (- 0 100000000000000000000) 1)", env);
+    ASSERT_TRUE(IS_FALSE(result));
+
+    ASSERT_TRUE(IS_NIL(eval_str("(/ 1 0)", env)));
+    ASSERT_TRUE(IS_NIL(eval_str("(mod (fact 25) 0)", env)));
+}
+
+TEST(floats)
+{
+    struct env *env = env_new();
+    struct atom *result;
+
+    result = eval_str("(+ 1.5 2)", env);
+    ASSERT_TRUE(IS_FLOAT(result));
+    ASSERT_TRUE(FLOAT_VAL(result) == 3.5);
+
+    result = eval_str("(* 1e9 2.5e-3)", env);
+    ASSERT_TRUE(FLOAT_VAL(result) == 2.5e6);
+
+    result = eval_str("(/ 1 4.)", env);
+    ASSERT_TRUE(FLOAT_VAL(result) == 0.25);
+
+    result = eval_str("(- 100000000000000000000 0.5)", env);
+    ASSERT_TRUE(IS_FLOAT(result));
+    ASSERT_TRUE(FLOAT_VAL(result) == 1e20);
+
+    result = eval_str("(> 2 1.5)", env);
+    ASSERT_TRUE(IS_TRUE(result));
+    result = eval_str("(> 1.5 2)", env);
+    ASSERT_TRUE(IS_FALSE(result));
+
+    result = eval_str("(eq 0.5 (/ 1 2.0))", env);
+    ASSERT_TRUE(IS_TRUE(result));
+    result = eval_str("(eq 1 1.0)", env);
+    ASSERT_TRUE(IS_FALSE(result));
+
+    result = eval_str("(quote (1.5 1e300))", env);
+    ASSERT_TRUE(IS_LIST(result));
+    ASSERT_TRUE(FLOAT_VAL(CAR(result->list.first)) == 1.5);
+    ASSERT_TRUE(FLOAT_VAL(CAR(CDR(result->list.first))) == 1e300);
+}
+
+TEST(tail_calls_run_in_constant_stack)
+{
+    enum eval_mode saved = eval_mode;
+    enum eval_mode modes[] = { EVAL_AST, EVAL_ANALYZE, EVAL_VM };
+    unsigned i;
+
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i)
+    {
+        struct env *env = env_new();
+        struct atom *result;
+
+        eval_mode = modes[i];
+
+        eval_str("(define loop (lambda (n acc) "
+            "(if (eq n 0) acc (loop (- n 1) (+ acc 1)))))", env);
+        eval_str("(define even (lambda (n) (if (eq n 0) #t (odd (- n 1)))))",
+            env);
+        eval_str("(define odd (lambda (n) (if (eq n 0) #f (even (- n 1)))))",
+            env);
+
+        result = eval_str("(loop 1000000 0)", env);
+        ASSERT_TRUE(IS_INT(result));
+        ASSERT_EQ(1000000, INT_VAL(result));
+
+        result = eval_str("(even 1000001)", env);
+        ASSERT_TRUE(IS_FALSE(result));
+    }
+
+    eval_mode = saved;
+}
+
+TEST(arity_is_checked_before_evaluating_args)
+{
+    enum eval_mode saved = eval_mode;
+    enum eval_mode modes[] = { EVAL_AST, EVAL_ANALYZE, EVAL_VM };
+    struct atom *result;
+    unsigned i;
+
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i)
+    {
+        struct env *env = env_new();
+
+        eval_mode = modes[i];
+
+        ASSERT_TRUE(IS_NIL(eval_str("((lambda (x) x) (define a 1) 2)", env)));
+        ASSERT_TRUE(IS_NIL(eval_str("(+ (define b 1))", env)));
+        ASSERT_TRUE(IS_NIL(eval_str("(1 (define c 1))", env)));
+
+        // The failed call is not in tail position here
+        result = eval_str("(null? ((lambda () 1) (define d 1)))", env);
+        ASSERT_TRUE(IS_TRUE(result));
+
+        ASSERT_EQ(NULL, env_lookup(env, "a"));
+        ASSERT_EQ(NULL, env_lookup(env, "b"));
+        ASSERT_EQ(NULL, env_lookup(env, "c"));
+        ASSERT_EQ(NULL, env_lookup(env, "d"));
+    }
+
+    eval_mode = saved;
+}
+
+// Runs the same program with each evaluator and checks that they agree.
+
+TEST(evaluators_agree)
+{
+    static const char *program[] = {
+        "(+ 1 2)",
+        "(if (> 2 1) (quote yes) (quote no))",
+        "(define sq (lambda (x) (* x x)))",
+        "(sq 12)",
+        "(define adder (lambda (n) (lambda (x) (+ x n))))",
+        "((adder 40) 2)",
+        "(define f (lambda (x) (if (> x 0) (g x) 0)))",
+        "(define g (lambda (x) (+ x 1)))",
+        "(f 5)",
+        "(define h (lambda (x) (if (define y (* x 2)) (+ x y) 0)))",
+        "(h 7)",
+        "(define fib (lambda (n) (if (> 2 n) n (+ (fib (- n 1)) (fib (- n 2))))))",
+        "(fib 15)",
+        "((if #f - *) 6 7)",
+        "(quote (1 (2 3) foo))",
+        "(eq (quote a) (quote a))",
+        "((lambda (+) (+ 1 2)) -)",
+        "(sq 1 2)",
+        "(undefined-function 1)",
+        "(1 2)",
+        "(if 1 2)",
+        "(define 1 2)",
+        "(lambda (1) 1)",
+        "(quote)",
+        "(define k (lambda (a) (if (define b (+ a 1)) 0 b)))",
+        "(k 1)",
+        "(define q 5)",
+        "(define m (lambda () (if #f (define q 1) q)))",
+        "(m)",
+        "((lambda (x x) x) 1 2)",
+        "((lambda (x) (define x 2)) 1)",
+        "(define v (make-vector 3 0))",
+        "(vector-set! v 1 (sq 3))",
+        "(vector->list v)",
+        "(vector-ref #(1 (2) \"s\") 1)",
+        "(vector-ref v 3)",
+        "(define rev (lambda (l acc) (if (null? l) acc "
+            "(rev (cdr l) (cons (car l) acc)))))",
+        "(rev (list 1 2 3) (quote ()))",
+        "(append (reverse (list 1 2)) (cdr (list 0 3)))",
+        "(length (cons 1 (list 2)))",
+        "(car 1)",
+        "(/ (+ (sq 1.5) 0.75) 2)",
+        "(> (* 2 0.5) 1)",
+        NULL
+    };
+
+    enum eval_mode saved = eval_mode;
+    enum eval_mode modes[] = { EVAL_ANALYZE, EVAL_VM };
+    struct env *ast_env = env_new();
+    struct env *envs[] = { env_new(), env_new() };
+    const char **expr;
+    unsigned i;
+
+    for (expr = program; *expr; ++expr)
+    {
+        struct atom *expected, *result;
+
+        eval_mode = EVAL_AST;
+        expected = eval_str(*expr, ast_env);
+
+        for (i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i)
+        {
+            eval_mode = modes[i];
+            result = eval_str(*expr, envs[i]);
+
+            ASSERT_MSG(atom_cmp(expected, result), "mode %d: %s", modes[i],
+                *expr);
+        }
+    }
+
+    eval_mode = saved;
+}
+
 #endif /* BUILD_TEST */
@@ -3,8 +3,32 @@
 
 struct atom;
 struct env;
+struct primitive;
+
+// eval runs expressions with the tree-walking evaluator, by analyzing
+// them into trees of nodes (see analyze.h) or by compiling them for the
+// bytecode VM (the default). The initial mode can be picked by setting
+// LISPISH_EVAL to "ast", "analyze" or "vm".
+enum eval_mode
+{
+    EVAL_AST,
+    EVAL_ANALYZE,
+    EVAL_VM
+};
+
+extern enum eval_mode eval_mode;
 
 struct atom *eval(struct atom *expr, struct env *env);
+struct atom *eval_ast(struct atom *expr, struct env *env);
 struct atom *eval_str(const char *expr, struct env *env);
 
+// Prints an error and returns zero unless the primitive accepts argc
+// arguments.
+int eval_check_arity(const struct primitive *primitive, int argc);
+
+struct atom *builtin_quote(struct atom *expr, struct env *env);
+struct atom *builtin_if(struct atom *expr, struct env *env);
+struct atom *builtin_define(struct atom *expr, struct env *env);
+struct atom *builtin_lambda(struct atom *expr, struct env *env);
+
 #endif
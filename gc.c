@@ -0,0 +1,670 @@
+#define _GNU_SOURCE
+
+#include "gc.h"
+#include "atom.h"
+#include "env.h"
+#include "vm.h"
+#include "analyze.h"
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef GC_DEFAULT_THRESHOLD
+#define GC_DEFAULT_THRESHOLD (8 * 1024 * 1024)
+#endif
+
+// Small objects (atoms, lists, environments, short strings and binding
+// arrays) are carved out of SLAB_SIZE aligned slabs, one size class per
+// multiple of SLAB_ALIGN bytes. Each slab starts with a struct slab
+// followed by a kind byte and a mark byte per object, then the objects
+// themselves. Free objects of a size class are chained through their
+// first word.
+//
+// Anything larger than SLAB_MAX_OBJECT gets its own allocation preceded
+// by a struct gc_header. With GC_USE_MALLOC defined every object is
+// allocated that way, which keeps tools like AddressSanitizer useful.
+//
+// Both slabs and large objects are kept in arrays which are sorted by
+// address when a collection starts, so that arbitrary words found on the
+// C stack can be mapped back to the object they point into.
+
+#ifdef GC_USE_MALLOC
+#define GC_SLABS 0
+#else
+#define GC_SLABS 1
+#endif
+
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_ALIGN 16
+#define SLAB_MAX_OBJECT 256
+#define SLAB_CLASSES (SLAB_MAX_OBJECT / SLAB_ALIGN)
+#define SLAB_FREE 0xff
+
+struct slab
+{
+    size_t object_size;
+    int object_count;
+    int live;
+    char *objects;
+    unsigned char *marks;
+    unsigned char kinds[];
+};
+
+struct gc_header
+{
+    size_t size;
+    unsigned char kind;
+    unsigned char mark;
+} __attribute__((aligned(16)));
+
+#define HEADER_PAYLOAD(H) ((char *)((H) + 1))
+
+// What gc_find reports about the object containing a pointer.
+struct gc_object
+{
+    void *payload;
+    unsigned char *mark;
+    unsigned char kind;
+};
+
+static struct
+{
+    struct slab **slabs;
+    size_t slab_count;
+    size_t slab_capacity;
+    void *free_lists[SLAB_CLASSES];
+
+    struct gc_header **large;
+    size_t large_count;
+    size_t large_capacity;
+
+    struct gc_object *gray;
+    size_t gray_count;
+    size_t gray_capacity;
+
+    const void **roots;
+    size_t root_count;
+    size_t root_capacity;
+
+    size_t threshold;
+    size_t objects;
+    size_t bytes;
+    size_t bytes_since_collect;
+    size_t collections;
+    size_t freed_objects;
+    size_t freed_bytes;
+
+    int collecting;
+    void *stack_top;
+} gc = {
+    .threshold = GC_DEFAULT_THRESHOLD
+};
+
+static void *grow(void *array, size_t *capacity, size_t elem_size)
+{
+    *capacity = *capacity ? *capacity * 2 : 256;
+    array = realloc(array, *capacity * elem_size);
+
+    if (!array)
+        abort();
+
+    return array;
+}
+
+static struct slab *slab_new(size_t object_size)
+{
+    struct slab *slab = aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+    size_t count, meta;
+    int i;
+
+    if (!slab)
+        abort();
+
+    count = (SLAB_SIZE - sizeof(*slab)) / (object_size + 2);
+
+    do
+    {
+        meta = sizeof(*slab) + 2 * count;
+        meta = (meta + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    } while (meta + count * object_size > SLAB_SIZE && --count);
+
+    slab->object_size = object_size;
+    slab->object_count = count;
+    slab->live = 0;
+    slab->objects = (char *)slab + meta;
+    slab->marks = slab->kinds + count;
+
+    memset(slab->kinds, SLAB_FREE, count);
+    memset(slab->marks, 0, count);
+
+    // Chain the objects so that they are handed out in address order.
+    for (i = count - 1; i >= 0; --i)
+    {
+        void **object = (void **)(slab->objects + i * object_size);
+        int class = object_size / SLAB_ALIGN - 1;
+
+        *object = gc.free_lists[class];
+        gc.free_lists[class] = object;
+    }
+
+    if (gc.slab_count == gc.slab_capacity)
+        gc.slabs = grow(gc.slabs, &gc.slab_capacity, sizeof(*gc.slabs));
+
+    gc.slabs[gc.slab_count++] = slab;
+
+    return slab;
+}
+
+#define SLAB_OF(PTR) \
+    ((struct slab *)((uintptr_t)(PTR) & ~(uintptr_t)(SLAB_SIZE - 1)))
+
+static void *slab_alloc(size_t size, int kind)
+{
+    int class = size ? (size - 1) / SLAB_ALIGN : 0;
+    size_t object_size = (class + 1) * SLAB_ALIGN;
+    void **object = gc.free_lists[class];
+    struct slab *slab;
+
+    if (!object)
+    {
+        slab_new(object_size);
+        object = gc.free_lists[class];
+    }
+
+    gc.free_lists[class] = *object;
+
+    slab = SLAB_OF(object);
+    slab->kinds[((char *)object - slab->objects) / object_size] = kind;
+    slab->live += 1;
+
+    memset(object, 0, object_size);
+
+    gc.bytes += object_size;
+    gc.bytes_since_collect += object_size;
+
+    return object;
+}
+
+static void *large_alloc(size_t size, int kind)
+{
+    struct gc_header *header = calloc(1, sizeof(*header) + size);
+
+    if (!header)
+        abort();
+
+    header->size = size;
+    header->kind = kind;
+
+    if (gc.large_count == gc.large_capacity)
+        gc.large = grow(gc.large, &gc.large_capacity, sizeof(*gc.large));
+
+    gc.large[gc.large_count++] = header;
+
+    gc.bytes += size;
+    gc.bytes_since_collect += size;
+
+    return HEADER_PAYLOAD(header);
+}
+
+void *gc_alloc(size_t size, int kind)
+{
+    if (gc.threshold && gc.bytes_since_collect >= gc.threshold)
+        gc_collect();
+
+    gc.objects += 1;
+
+    if (GC_SLABS && size <= SLAB_MAX_OBJECT)
+        return slab_alloc(size, kind);
+
+    return large_alloc(size, kind);
+}
+
+char *gc_strndup(const char *str, int len)
+{
+    char *copy = gc_alloc(len + 1, GC_STRING);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+static int compare_pointers(const void *a, const void *b)
+{
+    const void *pa = *(const void **)a;
+    const void *pb = *(const void **)b;
+
+    if (pa < pb)
+        return -1;
+
+    return pa > pb;
+}
+
+// Returns the index of the last element of a sorted pointer array that
+// is not above ptr, or -1 when there is none.
+
+static long find_floor(void **array, size_t count, const void *ptr)
+{
+    size_t lo = 0, hi = count;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (array[mid] <= ptr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return (long)lo - 1;
+}
+
+// Looks up the object containing ptr. Returns zero when ptr does not
+// point into an allocated object of the collected heap. Interior pointers
+// are accepted. Only valid while a collection is running (the slab and
+// large object arrays must be sorted).
+
+static int gc_find(const void *ptr, struct gc_object *object)
+{
+    long i;
+
+    if (gc.slab_count)
+    {
+        struct slab *slab = SLAB_OF(ptr);
+
+        i = find_floor((void **)gc.slabs, gc.slab_count, slab);
+
+        if (i >= 0 && gc.slabs[i] == slab)
+        {
+            size_t index;
+
+            if ((const char *)ptr < slab->objects)
+                return 0;
+
+            index = ((const char *)ptr - slab->objects) / slab->object_size;
+
+            if (index >= (size_t)slab->object_count ||
+                slab->kinds[index] == SLAB_FREE)
+            {
+                return 0;
+            }
+
+            object->payload = slab->objects + index * slab->object_size;
+            object->mark = &slab->marks[index];
+            object->kind = slab->kinds[index];
+
+            return 1;
+        }
+    }
+
+    i = find_floor((void **)gc.large, gc.large_count, ptr);
+
+    if (i >= 0)
+    {
+        struct gc_header *header = gc.large[i];
+        const char *payload = HEADER_PAYLOAD(header);
+
+        if ((const char *)ptr >= payload &&
+            (const char *)ptr < payload + header->size)
+        {
+            object->payload = HEADER_PAYLOAD(header);
+            object->mark = &header->mark;
+            object->kind = header->kind;
+
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void gc_mark(const void *ptr)
+{
+    struct gc_object object;
+
+    if (!ptr || !gc.collecting)
+        return;
+
+    if (!gc_find(ptr, &object) || *object.mark)
+        return;
+
+    *object.mark = 1;
+
+    if (gc.gray_count == gc.gray_capacity)
+        gc.gray = grow(gc.gray, &gc.gray_capacity, sizeof(*gc.gray));
+
+    gc.gray[gc.gray_count++] = object;
+}
+
+int gc_is_marked(const void *ptr)
+{
+    struct gc_object object;
+    return !gc_find(ptr, &object) || *object.mark;
+}
+
+static void gc_trace(struct gc_object *object)
+{
+    void *payload = object->payload;
+
+    switch (object->kind)
+    {
+    case GC_ATOM: atom_gc_trace(payload); break;
+    case GC_PAIR: pair_gc_trace(payload); break;
+    case GC_ENV: env_gc_trace(payload); break;
+    case GC_KV: break; // traced by the owning environment
+    case GC_STRING: break;
+    case GC_PROTO: proto_gc_trace(payload); break;
+    case GC_NODE: node_gc_trace(payload); break;
+    case GC_DATA: break; // traced by the owning function
+    }
+}
+
+static void gc_drain()
+{
+    while (gc.gray_count)
+    {
+        struct gc_object object = gc.gray[--gc.gray_count];
+        gc_trace(&object);
+    }
+}
+
+static void gc_find_stack_top()
+{
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+
+    if (pthread_getattr_np(pthread_self(), &attr) != 0)
+        abort();
+
+    pthread_attr_getstack(&attr, &addr, &size);
+    pthread_attr_destroy(&attr);
+
+    gc.stack_top = (char *)addr + size;
+}
+
+// Conservatively marks everything that looks like a pointer between the
+// current stack frame and the top of the stack. Called from gc_collect
+// after the callee-saved registers have been spilled to its frame.
+
+__attribute__((noinline, no_sanitize_address))
+static void gc_scan_stack()
+{
+    void *marker = NULL;
+    void **word = &marker;
+
+    if (!gc.stack_top)
+        gc_find_stack_top();
+
+    for (; (void *)word < gc.stack_top; ++word)
+        gc_mark(*word);
+}
+
+static void gc_free_object(size_t size)
+{
+    gc.objects -= 1;
+    gc.bytes -= size;
+    gc.freed_bytes += size;
+    gc.freed_objects += 1;
+}
+
+// Frees unmarked slab objects and rebuilds the free lists from scratch,
+// returning completely empty slabs to the system.
+
+static void gc_sweep_slabs()
+{
+    size_t s, live_slabs = 0;
+    int i;
+
+    memset(gc.free_lists, 0, sizeof(gc.free_lists));
+
+    for (s = 0; s < gc.slab_count; ++s)
+    {
+        struct slab *slab = gc.slabs[s];
+        int class = slab->object_size / SLAB_ALIGN - 1;
+        void *free_list = gc.free_lists[class];
+
+        for (i = slab->object_count - 1; i >= 0; --i)
+        {
+            void **object = (void **)(slab->objects + i * slab->object_size);
+
+            if (slab->kinds[i] != SLAB_FREE)
+            {
+                if (slab->marks[i])
+                {
+                    slab->marks[i] = 0;
+                    continue;
+                }
+
+                slab->kinds[i] = SLAB_FREE;
+                slab->live -= 1;
+                gc_free_object(slab->object_size);
+            }
+
+            *object = free_list;
+            free_list = object;
+        }
+
+        if (slab->live == 0)
+        {
+            free(slab);
+            continue;
+        }
+
+        gc.free_lists[class] = free_list;
+        gc.slabs[live_slabs++] = slab;
+    }
+
+    gc.slab_count = live_slabs;
+}
+
+static void gc_sweep_large()
+{
+    size_t i, live = 0;
+
+    for (i = 0; i < gc.large_count; ++i)
+    {
+        struct gc_header *header = gc.large[i];
+
+        if (header->mark)
+        {
+            header->mark = 0;
+            gc.large[live++] = header;
+        }
+        else
+        {
+            gc_free_object(header->size);
+            free(header);
+        }
+    }
+
+    gc.large_count = live;
+}
+
+void gc_collect()
+{
+    jmp_buf registers;
+    size_t i;
+
+    if (gc.collecting)
+        return;
+
+    gc.collecting = 1;
+
+    qsort(gc.slabs, gc.slab_count, sizeof(*gc.slabs), compare_pointers);
+    qsort(gc.large, gc.large_count, sizeof(*gc.large), compare_pointers);
+
+    atom_gc_trace(&true_atom);
+    atom_gc_trace(&false_atom);
+    atom_gc_trace(&nil_atom);
+
+    for (i = 0; i < gc.root_count; ++i)
+        gc_mark(gc.roots[i]);
+
+    vm_gc_trace();
+
+    __builtin_unwind_init();
+    setjmp(registers);
+    gc_scan_stack();
+
+    gc_drain();
+    atom_gc_sweep_symbols();
+    gc_sweep_slabs();
+    gc_sweep_large();
+
+    gc.collections += 1;
+    gc.bytes_since_collect = 0;
+    gc.collecting = 0;
+}
+
+void gc_add_root(const void *ptr)
+{
+    if (gc.root_count == gc.root_capacity)
+        gc.roots = grow(gc.roots, &gc.root_capacity, sizeof(*gc.roots));
+
+    gc.roots[gc.root_count++] = ptr;
+}
+
+void gc_remove_root(const void *ptr)
+{
+    size_t i;
+
+    for (i = 0; i < gc.root_count; ++i)
+    {
+        if (gc.roots[i] == ptr)
+        {
+            gc.roots[i] = gc.roots[--gc.root_count];
+            return;
+        }
+    }
+}
+
+void gc_add_root_env(struct env *env)
+{
+    gc_add_root(env);
+}
+
+void gc_remove_root_env(struct env *env)
+{
+    gc_remove_root(env);
+}
+
+void gc_set_threshold(size_t bytes)
+{
+    gc.threshold = bytes;
+}
+
+size_t gc_get_threshold()
+{
+    return gc.threshold;
+}
+
+void gc_get_stats(struct gc_stats *stats)
+{
+    stats->collections = gc.collections;
+    stats->objects = gc.objects;
+    stats->slabs = gc.slab_count;
+    stats->bytes = gc.bytes;
+    stats->bytes_since_collect = gc.bytes_since_collect;
+    stats->freed_objects = gc.freed_objects;
+    stats->freed_bytes = gc.freed_bytes;
+}
+
+#ifdef BUILD_TEST
+
+#include "test_util.h"
+
+__attribute__((noinline))
+static void make_garbage(int count)
+{
+    while (count--)
+        atom_new_str("garbage", 7);
+}
+
+TEST(gc_frees_unreachable_atoms)
+{
+    struct gc_stats before, after;
+
+    gc_collect();
+    gc_get_stats(&before);
+
+    make_garbage(1000);
+
+    gc_collect();
+    gc_get_stats(&after);
+
+    // Each string atom consists of the atom itself and its payload. A
+    // few of them may still be referenced by stale stack slots.
+    ASSERT_TRUE(after.freed_objects - before.freed_objects >= 1900);
+    ASSERT_TRUE(after.objects <= before.objects + 100);
+}
+
+TEST(gc_keeps_root_env_bindings)
+{
+    struct env *env = env_new();
+
+    env_set(env, "foo", atom_new_str("foobar", 6));
+    env_set(env, "bar", atom_new_list_empty());
+
+    gc_collect();
+    make_garbage(100);
+    gc_collect();
+
+    struct atom *atom = env_lookup(env, "foo");
+    ASSERT_TRUE(atom != NULL);
+    ASSERT_EQ(ATOM_STR, ATOM_TYPE(atom));
+    ASSERT_STREQ("foobar", atom->str.str);
+
+    atom = env_lookup(env, "bar");
+    ASSERT_TRUE(atom != NULL);
+    ASSERT_EQ(ATOM_LIST, ATOM_TYPE(atom));
+
+    env_free(env);
+}
+
+TEST(gc_keeps_stack_references)
+{
+    struct atom *list = atom_list_append(atom_new_list_empty(), 2,
+        atom_new_int(1), atom_new_str("two", 3));
+
+    gc_collect();
+
+    ASSERT_EQ(ATOM_LIST, ATOM_TYPE(list));
+    ASSERT_EQ(2, atom_list_length(list));
+    ASSERT_EQ(1, INT_VAL(CAR(list->list.first)));
+    ASSERT_STREQ("two", CAR(CDR(list->list.first))->str.str);
+}
+
+TEST(gc_reuses_freed_slab_objects)
+{
+    struct gc_stats before, after;
+
+    make_garbage(10000);
+    gc_collect();
+    gc_get_stats(&before);
+
+    make_garbage(10000);
+    gc_collect();
+    gc_get_stats(&after);
+
+    ASSERT_TRUE(after.slabs <= before.slabs);
+}
+
+TEST(gc_automatic_collection)
+{
+    struct gc_stats before, after;
+    size_t threshold = gc_get_threshold();
+
+    gc_get_stats(&before);
+
+    gc_set_threshold(64 * 1024);
+    make_garbage(10000);
+    gc_set_threshold(threshold);
+
+    gc_get_stats(&after);
+
+    ASSERT_TRUE(after.collections > before.collections);
+}
+
+#endif /* BUILD_TEST */
@@ -0,0 +1,60 @@
+#ifndef GC_H
+#define GC_H
+
+#include <stddef.h>
+
+enum
+{
+    GC_ATOM,
+    GC_PAIR,
+    GC_ENV,
+    GC_KV,
+    GC_STRING,
+    GC_PROTO,
+    GC_NODE,
+    GC_DATA
+};
+
+struct env;
+
+struct gc_stats
+{
+    size_t collections;
+    size_t objects;
+    size_t slabs;
+    size_t bytes;
+    size_t bytes_since_collect;
+    size_t freed_objects;
+    size_t freed_bytes;
+};
+
+// Allocates a zeroed object of the given kind from the collected heap.
+void *gc_alloc(size_t size, int kind);
+char *gc_strndup(const char *str, int len);
+
+// Marks an object (and, transitively, everything it refers to) as
+// reachable. Pointers that do not belong to the collected heap are
+// ignored, so it is safe to pass static or stack allocated atoms.
+void gc_mark(const void *ptr);
+
+// Returns zero for heap objects not (yet) found reachable during the
+// current collection.
+int gc_is_marked(const void *ptr);
+
+// Objects registered as roots are kept alive until removed again.
+void gc_add_root(const void *ptr);
+void gc_remove_root(const void *ptr);
+
+void gc_add_root_env(struct env *env);
+void gc_remove_root_env(struct env *env);
+
+void gc_collect();
+
+// Automatic collection runs once the heap has grown by this many bytes
+// since the previous collection. Zero disables automatic collection.
+void gc_set_threshold(size_t bytes);
+size_t gc_get_threshold();
+
+void gc_get_stats(struct gc_stats *stats);
+
+#endif
@@ -1,18 +1,33 @@
 #include "parse.h"
 #include "tokens.h"
 #include "atom.h"
+#include "bignum.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 
 struct atom *parse_token(struct token *token)
 {
     switch (token->type)
     {
     case TOKEN_INT:
-        return atom_new_int(strtol(token->s, NULL, 10));
+    {
+        long l;
+
+        errno = 0;
+        l = strtol(token->s, NULL, 10);
+
+        if (errno == ERANGE)
+            return bignum_parse(token->s, token->len);
+
+        return atom_new_int(l);
+    }
+
+    case TOKEN_FLOAT:
+        return atom_new_float(strtod(token->s, NULL));
 
     case TOKEN_STR:
         return atom_new_str(token->s, token->len);
@@ -36,23 +51,28 @@ void parse_quote(const char *src, int *pos, struct atom **result)
 {
     struct atom *value = parse(src, pos);
     struct atom *q = atom_new_sym("quote", 5);
-    struct atom *form = atom_new_list_empty();
 
-    LIST_INSERT_HEAD(form->list, q, entries);
-    LIST_INSERT_AFTER(q, value, entries);
+    *result = atom_new_list(pair_new(q, pair_new(value, NULL)));
+}
+
+int parse_list(const char *src, int *pos, struct atom **result);
+
+int parse_vector(const char *src, int *pos, struct atom **result)
+{
+    struct atom *list;
+
+    if (parse_list(src, pos, &list) < 0)
+        return -1;
 
-    *result = form;
+    *result = atom_vector_from_list(list);
+    return 1;
 }
 
 int parse_list(const char *src, int *pos, struct atom **result)
 {
     struct token token;
     int rc;
-    struct list *list;
-    struct atom *last = NULL;
-
-    list = calloc(1, sizeof(*list));
-    LIST_INIT(list);
+    struct atom *list = atom_new_list_empty();
 
     while ((rc = get_next_token(src, pos, &token)))
     {
@@ -68,6 +88,11 @@ int parse_list(const char *src, int *pos, struct atom **result)
                 return -1;
             break;
 
+        case TOKEN_VECTOR:
+            if (parse_vector(src, pos, &atom) < 0)
+                return -1;
+            break;
+
         case TOKEN_RPAREN:
             goto out;
             break;
@@ -81,12 +106,7 @@ int parse_list(const char *src, int *pos, struct atom **result)
             break;
         }
 
-        if (!last)
-            LIST_INSERT_HEAD(list, atom, entries);
-        else
-            LIST_INSERT_AFTER(last, atom, entries);
-
-        last = atom;
+        atom_list_push(list, atom);
     }
 
 out:
@@ -94,14 +114,13 @@ out:
     if (rc < 0)
         return rc;
 
-    if (LIST_EMPTY(list))
+    if (!list->list.count)
     {
-        free(list);
         *result = &nil_atom;
         return 1;
     }
 
-    *result = atom_new_list(list);
+    *result = list;
     return 1;
 }
 
@@ -123,6 +142,11 @@ struct atom *parse(const char *src, int *pos)
             atom = NULL;
         break;
 
+    case TOKEN_VECTOR:
+        if (parse_vector(src, pos, &atom) < 0)
+            atom = NULL;
+        break;
+
     case TOKEN_RPAREN:
         printf("syntax error: unexpected ')'\n");
         break;
@@ -166,18 +190,20 @@ TEST(test_parse)
     ASSERT_TRUE(list != NULL);
     ASSERT_TRUE(IS_LIST(list));
 
-    struct atom *a = CAR(list->list);
-    ASSERT_TRUE(a != NULL);
-    ASSERT_SYM(a, "define");
+    struct pair *p = list->list.first;
+    ASSERT_TRUE(p != NULL);
+    ASSERT_SYM(CAR(p), "define");
 
-    a = CDR(a);
+    p = CDR(p);
 
-    ASSERT_TRUE(a != NULL);
-    ASSERT_SYM(a, "fact");
+    ASSERT_TRUE(p != NULL);
+    ASSERT_SYM(CAR(p), "fact");
 
-    a = CDR(a);
+    p = CDR(p);
 
-    ASSERT_TRUE(a != NULL);
+    ASSERT_TRUE(p != NULL);
+    ASSERT_TRUE(IS_LIST(CAR(p)));
+    ASSERT_TRUE(CDR(p) == NULL);
 }
 
 TEST(parse_quote)
@@ -186,17 +212,54 @@ TEST(parse_quote)
 
     struct atom *result = parse("'foobar", &pos);
     ASSERT_TRUE(result != NULL);
-    ASSERT_EQ(ATOM_LIST, result->type);
+    ASSERT_EQ(ATOM_LIST, ATOM_TYPE(result));
 
-    struct atom *op = CAR(result->list);
+    struct pair *op = result->list.first;
     ASSERT_TRUE(op != NULL);
-    ASSERT_EQ(ATOM_SYMBOL, op->type);
-    ASSERT_STREQ("quote", op->str.str);
+    ASSERT_EQ(ATOM_SYMBOL, ATOM_TYPE(CAR(op)));
+    ASSERT_STREQ("quote", CAR(op)->str.str);
 
-    struct atom *a = CDR(op);
+    struct pair *a = CDR(op);
     ASSERT_TRUE(a != NULL);
-    ASSERT_EQ(ATOM_SYMBOL, a->type);
-    ASSERT_STREQ("foobar", a->str.str);
+    ASSERT_EQ(ATOM_SYMBOL, ATOM_TYPE(CAR(a)));
+    ASSERT_STREQ("foobar", CAR(a)->str.str);
+}
+
+TEST(parse_long_list)
+{
+    int count = 200000;
+    char *src = malloc(count * 2 + 3);
+    struct atom *list;
+    int pos = 0;
+    int i;
+
+    src[0] = '(';
+    for (i = 0; i < count; ++i)
+        memcpy(src + 1 + i * 2, "7 ", 2);
+    strcpy(src + 1 + count * 2, ")");
+
+    list = parse(src, &pos);
+    free(src);
+
+    ASSERT_TRUE(IS_LIST(list));
+    ASSERT_EQ(count, atom_list_length(list));
+    ASSERT_EQ(7, INT_VAL(CAR(list->list.last)));
+}
+
+TEST(parse_vector)
+{
+    int pos = 0;
+
+    struct atom *result = parse("#(1 (2 3) \"four\" #())", &pos);
+    ASSERT_TRUE(result != NULL);
+    ASSERT_TRUE(IS_VECTOR(result));
+    ASSERT_EQ(4, result->vector.len);
+
+    ASSERT_EQ(1, INT_VAL(result->vector.items[0]));
+    ASSERT_TRUE(IS_LIST(result->vector.items[1]));
+    ASSERT_STREQ("four", result->vector.items[2]->str.str);
+    ASSERT_TRUE(IS_VECTOR(result->vector.items[3]));
+    ASSERT_EQ(0, result->vector.items[3]->vector.len);
 }
 
 #endif
@@ -0,0 +1,400 @@
+#include "reader.h"
+#include "parse.h"
+#include "tokens.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+// Forms are limited in size so that positions in the buffer fit in an
+// int, as parse and get_next_token expect.
+#define MAX_CAPACITY (1 << 30)
+
+static int initial_capacity = 4096;
+
+static void init(struct reader *reader, FILE *file, int fd)
+{
+    memset(reader, 0, sizeof(*reader));
+
+    reader->file = file;
+    reader->fd = fd;
+    reader->capacity = initial_capacity;
+    reader->buf = malloc(reader->capacity);
+    reader->buf[0] = '\0';
+}
+
+void reader_init(struct reader *reader, int fd)
+{
+    init(reader, NULL, fd);
+}
+
+void reader_init_file(struct reader *reader, FILE *file)
+{
+    init(reader, file, -1);
+}
+
+void reader_release(struct reader *reader)
+{
+    free(reader->buf);
+    reader->buf = NULL;
+}
+
+// Stops at the end of a line, so that a form typed at a terminal is read
+// without waiting for more.
+static int read_file(FILE *file, char *buf, int size)
+{
+    int count = 0;
+    int c;
+
+    while (count < size && (c = getc(file)) != EOF)
+    {
+        buf[count++] = c;
+
+        if (c == '\n')
+            break;
+    }
+
+    return ferror(file) ? -1 : count;
+}
+
+static int read_fd(int fd, char *buf, int size)
+{
+    ssize_t count;
+
+    do
+        count = read(fd, buf, size);
+    while (count < 0 && errno == EINTR);
+
+    return count;
+}
+
+static void drop(struct reader *reader, int count)
+{
+    memmove(reader->buf, reader->buf + count, reader->len - count + 1);
+
+    reader->len -= count;
+    reader->start -= count;
+    reader->scan -= count;
+    reader->offset += count;
+}
+
+static void skip_comment(struct reader *reader)
+{
+    char *newline = memchr(reader->buf + reader->scan, '\n',
+        reader->len - reader->scan);
+
+    if (newline)
+        reader->in_comment = 0;
+
+    reader->scan = newline ? newline - reader->buf : reader->len;
+    reader->start = reader->scan;
+}
+
+// Reads more input after the form being read, dropping what came before
+// it and growing the buffer if the form fills it.
+static int fill(struct reader *reader)
+{
+    char *end;
+    char *nul;
+    int count;
+
+    if (reader->start > 0)
+        drop(reader, reader->start);
+
+    if (reader->len + 1 == reader->capacity)
+    {
+        if (reader->capacity >= MAX_CAPACITY)
+            return -1;
+
+        reader->capacity *= 2;
+        reader->buf = realloc(reader->buf, reader->capacity);
+    }
+
+    end = reader->buf + reader->len;
+    count = reader->capacity - 1 - reader->len;
+
+    if (reader->file)
+        count = read_file(reader->file, end, count);
+    else
+        count = read_fd(reader->fd, end, count);
+
+    if (count <= 0)
+    {
+        reader->eof = 1;
+        return count;
+    }
+
+    if ((nul = memchr(end, '\0', count)))
+    {
+        count = nul - end;
+        reader->eof = 1;
+    }
+
+    reader->len += count;
+    reader->buf[reader->len] = '\0';
+
+    if (reader->in_comment)
+        skip_comment(reader);
+
+    return 0;
+}
+
+// Skips the rest of the line after an error, dropping the form read so
+// far.
+static int syntax_error(struct reader *reader, const char *at)
+{
+    reader->form_offset = reader->offset + (at - reader->buf);
+    reader->depth = 0;
+    reader->start = reader->scan = at - reader->buf;
+    reader->in_comment = 1;
+
+    skip_comment(reader);
+
+    return -1;
+}
+
+// Drops the whitespace and comments after the last form, remembering
+// whether they end inside a comment.
+static void skip_blank(struct reader *reader)
+{
+    const char *line = reader->buf + reader->len;
+
+    while (line > reader->buf + reader->scan && line[-1] != '\n')
+        --line;
+
+    if (line > reader->buf + reader->scan)
+        reader->in_comment = 0;
+
+    if (memchr(line, ';', reader->buf + reader->len - line))
+        reader->in_comment = 1;
+
+    reader->start = reader->scan = reader->len;
+}
+
+// Symbols and numbers that reach the end of the buffer may go on in the
+// input not read yet.
+static int may_be_cut(const struct token *token)
+{
+    return token->type == TOKEN_SYMBOL || token->type == TOKEN_INT ||
+        token->type == TOKEN_FLOAT;
+}
+
+// The tokenizer fails on strings and numbers cut off by the end of the
+// buffer ("abc and 1e); anything else is a syntax error. token->s is
+// just after the quote for strings.
+static int is_cut(struct reader *reader, const struct token *token)
+{
+    const char *s = token->s;
+    const char *end = reader->buf + reader->len;
+
+    if (s > reader->buf && s[-1] == '"' && !memchr(s, '"', end - s))
+        return 1;
+
+    return s + strcspn(s, " \t\n\v\f\r()") == end;
+}
+
+static int read_form(struct reader *reader, struct atom **result)
+{
+    int pos = reader->start;
+
+    reader->form_offset = reader->offset + reader->start;
+    *result = parse(reader->buf, &pos);
+    reader->start = reader->scan;
+
+    return *result ? 1 : -1;
+}
+
+int reader_next(struct reader *reader, struct atom **result)
+{
+    struct token token;
+    int pos;
+    int rc;
+
+    for (;;)
+    {
+        pos = reader->scan;
+        rc = get_next_token(reader->buf, &pos, &token);
+
+        if (rc > 0 && (pos < reader->len || reader->eof ||
+            !may_be_cut(&token)))
+        {
+            // Leading whitespace and comments are not part of the form
+            if (reader->start == reader->scan)
+                reader->start = token.s - reader->buf;
+
+            reader->scan = pos;
+
+            if (token.type == TOKEN_LPAREN || token.type == TOKEN_VECTOR)
+                reader->depth += 1;
+
+            if (token.type == TOKEN_RPAREN)
+            {
+                if (!reader->depth)
+                    return syntax_error(reader, token.s);
+
+                reader->depth -= 1;
+            }
+
+            if (!reader->depth && token.type != TOKEN_QUOTE)
+                return read_form(reader, result);
+
+            continue;
+        }
+
+        if (rc < 0 && (reader->eof || !is_cut(reader, &token)))
+            return syntax_error(reader, token.s);
+
+        if (!rc && reader->start == reader->scan)
+            skip_blank(reader);
+
+        if (reader->eof)
+        {
+            if (reader->start == reader->scan)
+                return 0;
+
+            // The input ends inside a form
+            return syntax_error(reader, reader->buf + reader->len);
+        }
+
+        if (fill(reader) < 0)
+        {
+            reader->eof = 1;
+            return syntax_error(reader, reader->buf + reader->len);
+        }
+    }
+}
+
+#ifdef BUILD_TEST
+
+#include "test_util.h"
+#include "atom.h"
+
+static const char *test_src =
+    "(define greeting \"hello,\n world\") ; a comment\n"
+    "'(1 2.5 #(3)) 12345678901234567890\n"
+    "  foo";
+
+static FILE *temp_file(const char *src)
+{
+    FILE *file = tmpfile();
+
+    fputs(src, file);
+    rewind(file);
+
+    return file;
+}
+
+static void check_forms(struct reader *reader)
+{
+    struct atom *atom;
+
+    ASSERT_EQ(1, reader_next(reader, &atom));
+    ASSERT_TRUE(IS_LIST(atom));
+    ASSERT_EQ(3, atom_list_length(atom));
+    ASSERT_STREQ("hello,\n world", CAR(CDDR(atom->list.first))->str.str);
+    ASSERT_EQ(0, reader->form_offset);
+
+    ASSERT_EQ(1, reader_next(reader, &atom));
+    ASSERT_TRUE(IS_LIST(atom));
+    ASSERT_STREQ("quote", CAR(atom->list.first)->str.str);
+    ASSERT_EQ(46, reader->form_offset);
+
+    ASSERT_EQ(1, reader_next(reader, &atom));
+    ASSERT_EQ(ATOM_BIGNUM, ATOM_TYPE(atom));
+
+    ASSERT_EQ(1, reader_next(reader, &atom));
+    ASSERT_TRUE(IS_SYM(atom));
+    ASSERT_STREQ("foo", atom->str.str);
+    ASSERT_EQ(83, reader->form_offset);
+
+    ASSERT_EQ(0, reader_next(reader, &atom));
+    ASSERT_EQ(0, reader_next(reader, &atom));
+}
+
+TEST(reader_tokens_span_buffers)
+{
+    struct reader reader;
+    FILE *file = temp_file(test_src);
+
+    // Every token is split over several reads
+    initial_capacity = 4;
+
+    reader_init(&reader, fileno(file));
+    check_forms(&reader);
+    reader_release(&reader);
+
+    rewind(file);
+
+    reader_init_file(&reader, file);
+    check_forms(&reader);
+    reader_release(&reader);
+
+    initial_capacity = 4096;
+    fclose(file);
+}
+
+TEST(reader_memory_is_bounded_by_form_size)
+{
+    struct reader reader;
+    struct atom *atom;
+    FILE *file = tmpfile();
+    int count = 0;
+    int i;
+
+    fputs("; ", file);
+    for (i = 0; i < 100000; ++i)
+        fputs("a long comment (", file);
+    fputs("\n", file);
+
+    for (i = 0; i < 100000; ++i)
+        fputs("(+ 1 2) ; three\n", file);
+
+    rewind(file);
+
+    initial_capacity = 16;
+    reader_init(&reader, fileno(file));
+
+    while (reader_next(&reader, &atom) > 0)
+        count += 1;
+
+    ASSERT_EQ(100000, count);
+    ASSERT_EQ(16, reader.capacity);
+
+    reader_release(&reader);
+    initial_capacity = 4096;
+    fclose(file);
+}
+
+TEST(reader_recovers_after_syntax_errors)
+{
+    struct reader reader;
+    struct atom *atom;
+    FILE *file = temp_file("(a b)) (c\n(d)\n\x01 (e)\n(f) 12x (g)\n(h");
+
+    reader_init_file(&reader, file);
+
+    ASSERT_EQ(1, reader_next(&reader, &atom));
+    ASSERT_EQ(2, atom_list_length(atom));
+
+    // The rest of each line is skipped after an error
+    ASSERT_EQ(-1, reader_next(&reader, &atom));
+    ASSERT_EQ(5, reader.form_offset);
+    ASSERT_EQ(1, reader_next(&reader, &atom));
+    ASSERT_STREQ("d", CAR(atom->list.first)->str.str);
+
+    ASSERT_EQ(-1, reader_next(&reader, &atom));
+    ASSERT_EQ(1, reader_next(&reader, &atom));
+    ASSERT_STREQ("f", CAR(atom->list.first)->str.str);
+
+    ASSERT_EQ(-1, reader_next(&reader, &atom));
+
+    // Unexpected end of input
+    ASSERT_EQ(-1, reader_next(&reader, &atom));
+    ASSERT_EQ(0, reader_next(&reader, &atom));
+
+    reader_release(&reader);
+    fclose(file);
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef READER_H
+#define READER_H
+
+#include <stdio.h>
+
+struct atom;
+
+// Reads top-level forms from a FILE or a file descriptor one at a time,
+// so that input of any size can be evaluated as it arrives. Only the form
+// being read is buffered: a form is returned as soon as its last token is
+// complete, and the bytes before it are dropped. Input must not contain
+// NUL bytes; one ends the input.
+
+struct reader
+{
+    FILE *file;     // read with getc if set, else with read(2) from fd
+    int fd;
+    int eof;
+
+    char *buf;
+    int len;
+    int capacity;
+
+    int start;      // first byte of the form being read
+    int scan;       // end of its last complete token
+    int depth;      // lists and vectors it has left open
+    int in_comment; // the bytes dropped last ended inside a comment
+
+    long long offset;       // position of buf[0] in the input
+    long long form_offset;  // position of the last form or error
+};
+
+void reader_init(struct reader *reader, int fd);
+void reader_init_file(struct reader *reader, FILE *file);
+void reader_release(struct reader *reader);
+
+// Returns 1 and sets *result to the next form, 0 at the end of the input
+// and -1 for a syntax error, a form that does not fit in a gigabyte or a
+// read error. After a syntax error reading goes on at the next line.
+int reader_next(struct reader *reader, struct atom **result);
+
+#endif
@@ -1,20 +1,71 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "parse.h"
+#include "reader.h"
 #include "eval.h"
 #include "env.h"
 #include "atom.h"
+#include "gc.h"
+#include "vm.h"
 #include "linenoise.h"
 
-int main()
+// Evaluates and prints the forms of a file one at a time as they are
+// read, so that files of any size can be run. "-" reads standard input.
+static int run_file(const char *path, struct env *env)
+{
+    struct reader reader;
+    struct atom *expr;
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    int rc;
+
+    if (fd < 0)
+    {
+        perror(path);
+        return 1;
+    }
+
+    reader_init(&reader, fd);
+
+    while ((rc = reader_next(&reader, &expr)))
+    {
+        if (rc < 0)
+            printf("%s: syntax error at byte %lld\n", path,
+                reader.form_offset);
+        else
+            print_atom(eval(expr, env), 0);
+    }
+
+    reader_release(&reader);
+
+    if (fd != STDIN_FILENO)
+        close(fd);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
 {
     char *line;
     struct env *env;
+    int i;
 
     env = env_new();
 
+    if (argc > 1)
+    {
+        for (i = 1; i < argc; ++i)
+        {
+            if (run_file(argv[i], env))
+                return 1;
+        }
+
+        return 0;
+    }
+
     linenoiseSetMultiLine(0);
 
     while ((line = linenoise("> ")) != NULL)
@@ -26,6 +77,33 @@ int main()
             env_free(env);
             env = env_new();
         }
+        else if (strcmp(".gc", line) == 0)
+        {
+            struct gc_stats stats;
+
+            gc_collect();
+            gc_get_stats(&stats);
+
+            printf("%zu objects, %zu bytes live, %zu objects freed in "
+                "%zu collections\n", stats.objects, stats.bytes,
+                stats.freed_objects, stats.collections);
+        }
+        else if (strncmp(".gc-threshold ", line, 14) == 0)
+        {
+            gc_set_threshold(strtoul(line + 14, NULL, 10));
+        }
+        else if (strcmp(".cache", line) == 0)
+        {
+            size_t hits, misses;
+
+            env_get_cache_stats(&hits, &misses);
+            printf("%zu global lookup cache hits, %zu misses\n", hits,
+                misses);
+        }
+        else if (strncmp(".max-depth ", line, 11) == 0)
+        {
+            vm_set_max_depth(atoi(line + 11));
+        }
         else
         {
             struct atom *result = eval_str(line, env);
@@ -0,0 +1,150 @@
+#include "scope.h"
+#include "atom.h"
+#include "eval.h"
+#include "gc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void add_slot(struct scope *scope, struct atom *symbol)
+{
+    if (scope->slot_count == scope->slot_capacity)
+    {
+        scope->slot_capacity = scope->slot_capacity ?
+            scope->slot_capacity * 2 : 8;
+        scope->slots = realloc(scope->slots,
+            scope->slot_capacity * sizeof(*scope->slots));
+
+        if (!scope->slots)
+            abort();
+    }
+
+    scope->slots[scope->slot_count++] = symbol;
+}
+
+static int is_special(struct atom *expr, special_form_t special)
+{
+    struct atom *op;
+
+    if (!IS_LIST(expr) || !expr->list.first)
+        return 0;
+
+    op = CAR(expr->list.first);
+
+    return IS_SYM(op) && SYMBOL(op)->special == special;
+}
+
+// Records the symbols defined directly in the body of a lambda, that is,
+// outside of any nested lambda or quoted data.
+
+static void collect_defines(struct scope *scope, struct atom *expr)
+{
+    struct pair *elem;
+
+    if (!IS_LIST(expr) || is_special(expr, &builtin_quote) ||
+        is_special(expr, &builtin_lambda))
+    {
+        return;
+    }
+
+    if (is_special(expr, &builtin_define))
+    {
+        struct pair *name = CDR(expr->list.first);
+
+        if (name && IS_SYM(CAR(name)) && scope_slot(scope, CAR(name)) < 0)
+            add_slot(scope, CAR(name));
+    }
+
+    for (elem = expr->list.first; elem; elem = elem->cdr)
+        collect_defines(scope, elem->car);
+}
+
+void scope_init(struct scope *scope, struct scope *parent,
+    struct atom *params, struct atom *body)
+{
+    struct pair *param;
+
+    memset(scope, 0, sizeof(*scope));
+    scope->parent = parent;
+
+    if (IS_LIST(params))
+    {
+        for (param = params->list.first; param; param = param->cdr)
+            add_slot(scope, param->car);
+    }
+
+    collect_defines(scope, body);
+}
+
+void scope_release(struct scope *scope)
+{
+    free(scope->slots);
+}
+
+// The search runs backwards so that the last of duplicated parameters
+// wins, like it does when binding by name.
+
+int scope_slot(struct scope *scope, struct atom *symbol)
+{
+    int i;
+
+    for (i = scope->slot_count - 1; i >= 0; --i)
+    {
+        if (SYM_EQ(scope->slots[i], symbol))
+            return i;
+    }
+
+    return -1;
+}
+
+int scope_resolve(struct scope *scope, struct atom *symbol, int *depth)
+{
+    int slot;
+
+    for (*depth = 0; scope; scope = scope->parent, ++*depth)
+    {
+        slot = scope_slot(scope, symbol);
+
+        if (slot >= 0)
+            return slot;
+    }
+
+    return -1;
+}
+
+struct atom **scope_copy_slots(struct scope *scope)
+{
+    struct atom **slots;
+
+    if (!scope->slot_count)
+        return NULL;
+
+    slots = gc_alloc(scope->slot_count * sizeof(*slots), GC_DATA);
+    memcpy(slots, scope->slots, scope->slot_count * sizeof(*slots));
+
+    return slots;
+}
+
+const char *lambda_syntax_error(struct pair *op)
+{
+    struct pair *params = CDR(op);
+    struct pair *body = CDR(params);
+    struct pair *param;
+
+    if (!params || !body || CDR(body))
+        return "lambda takes exactly 2 arguments";
+
+    if (!IS_LIST(CAR(params)) && !IS_NIL(CAR(params)))
+        return "first arg to lambda must be a list";
+
+    if (IS_LIST(CAR(params)))
+    {
+        for (param = CAR(params)->list.first; param; param = param->cdr)
+        {
+            if (!IS_SYM(param->car))
+                return "lambda parameters must be symbols";
+        }
+    }
+
+    return NULL;
+}
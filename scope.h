@@ -0,0 +1,40 @@
+#ifndef SCOPE_H
+#define SCOPE_H
+
+struct atom;
+struct pair;
+
+// The lexical scope of a lambda while it is being compiled. Calling the
+// lambda creates one frame (see env_extend_slots) with a slot for each
+// parameter, in order, followed by one for each symbol defined in its
+// body.
+
+struct scope
+{
+    struct scope *parent;
+
+    struct atom **slots;
+    int slot_count;
+    int slot_capacity;
+};
+
+void scope_init(struct scope *scope, struct scope *parent,
+    struct atom *params, struct atom *body);
+void scope_release(struct scope *scope);
+
+// Returns the slot of symbol in the frame of scope, or -1.
+int scope_slot(struct scope *scope, struct atom *symbol);
+
+// Finds the innermost scope binding symbol and returns its slot, with
+// *depth set to how many frames up it is. Returns -1 for globals, with
+// *depth set to the number of enclosing lambdas.
+int scope_resolve(struct scope *scope, struct atom *symbol, int *depth);
+
+// Returns a collected copy of the slot symbols, or NULL if there are
+// none.
+struct atom **scope_copy_slots(struct scope *scope);
+
+// Returns the error message for a malformed lambda form, or NULL.
+const char *lambda_syntax_error(struct pair *op);
+
+#endif
@@ -1,122 +1,405 @@
 #include "tokens.h"
 
-#include <ctype.h>
+#include <stdint.h>
 
-int get_next_token(const char *src, int *pos, struct token *token)
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define TOKENS_SIMD 1
+#else
+#define TOKENS_SIMD 0
+#endif
+
+// Bytes are classified through a table rather than the <ctype.h>
+// functions, which are locale dependent calls. The classes are those of
+// the C locale.
+
+enum
 {
-    char c;
+    CHAR_SPACE = 1,
+    CHAR_DIGIT = 2,
+    CHAR_SYMBOL = 4,    // printable and not a paren
+    CHAR_BREAK = 8      // ends a number: NUL, whitespace or a paren
+};
+
+static const unsigned char char_class[256] = {
+    ['\0'] = CHAR_BREAK,
+    ['\t'] = CHAR_SPACE | CHAR_BREAK, ['\n'] = CHAR_SPACE | CHAR_BREAK,
+    ['\v'] = CHAR_SPACE | CHAR_BREAK, ['\f'] = CHAR_SPACE | CHAR_BREAK,
+    ['\r'] = CHAR_SPACE | CHAR_BREAK, [' '] = CHAR_SPACE | CHAR_BREAK,
+    ['('] = CHAR_BREAK, [')'] = CHAR_BREAK,
+    ['!' ... '\''] = CHAR_SYMBOL,
+    ['*' ... '/'] = CHAR_SYMBOL,
+    ['0' ... '9'] = CHAR_SYMBOL | CHAR_DIGIT,
+    [':' ... '~'] = CHAR_SYMBOL
+};
+
+#define CLASS(C) (char_class[(unsigned char)(C)])
+
+// Scanners return the first byte at or after p that ends a run of
+// whitespace, a comment, a string or a symbol; these macros tell whether
+// a single byte does. All of them stop at the terminating NUL.
+
+#define END_SPACE(C) (!(CLASS(C) & CHAR_SPACE))
+#define END_LINE(C) (!(C) || (C) == '\n')
+#define END_QUOTE(C) (!(C) || (C) == '"')
+#define END_SYMBOL(C) (!(CLASS(C) & CHAR_SYMBOL))
+
+struct scanners
+{
+    const char *(*skip_space)(const char *p);
+    const char *(*find_line_end)(const char *p);
+    const char *(*find_quote)(const char *p);
+    const char *(*find_delimiter)(const char *p);
+};
+
+#define SCAN_SCALAR(NAME, END) \
+    static const char *NAME(const char *p) \
+    { \
+        while (!END(*p)) \
+            ++p; \
+        \
+        return p; \
+    }
 
-start:
+SCAN_SCALAR(skip_space_scalar, END_SPACE)
+SCAN_SCALAR(find_line_end_scalar, END_LINE)
+SCAN_SCALAR(find_quote_scalar, END_QUOTE)
+SCAN_SCALAR(find_delimiter_scalar, END_SYMBOL)
+
+static const struct scanners scalar_scanners = {
+    skip_space_scalar,
+    find_line_end_scalar,
+    find_quote_scalar,
+    find_delimiter_scalar
+};
+
+#if TOKENS_SIMD
+
+// The SIMD scanners test a whole aligned block of 16 (SSE2) or 32 (AVX2)
+// bytes at once. The first block is loaded from below p, and the bytes
+// before p are shifted out of the mask of matches. An aligned block does
+// not cross a page boundary, so the bytes loaded past the terminating
+// NUL can be read safely, but AddressSanitizer would report them.
+//
+// Runs of one or two bytes (single spaces, short symbols) are common
+// enough that the first two bytes are checked on their own first.
+
+#define AVX2 __attribute__((target("avx2")))
+
+#define SCAN(NAME, TARGET, VEC, LOAD, STOP, END) \
+    __attribute__((no_sanitize_address)) TARGET \
+    static const char *NAME(const char *p) \
+    { \
+        uintptr_t offset = (uintptr_t)p % sizeof(VEC); \
+        const VEC *block = (const VEC *)(p - offset); \
+        unsigned mask; \
+        \
+        if (END(p[0])) \
+            return p; \
+        \
+        if (END(p[1])) \
+            return p + 1; \
+        \
+        mask = STOP(LOAD(block)) >> offset; \
+        \
+        if (mask) \
+            return p + __builtin_ctz(mask); \
+        \
+        do \
+            mask = STOP(LOAD(++block)); \
+        while (!mask); \
+        \
+        return (const char *)block + __builtin_ctz(mask); \
+    }
+
+// The stop_ functions return a bit mask of the bytes of a block that a
+// scan stops at. Whitespace is ' ' and '\t' to '\r', which is tested as
+// (x - '\t') <= 4 on unsigned bytes. Symbol bytes are those above ' '
+// as signed chars (which leaves out 0x80 and up) except DEL and parens.
+
+static inline unsigned stop_space_sse2(__m128i x)
+{
+    __m128i shifted = _mm_sub_epi8(x, _mm_set1_epi8('\t'));
+    __m128i space = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')),
+        _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8(4)), shifted));
+
+    return ~_mm_movemask_epi8(space) & 0xffff;
+}
+
+static inline unsigned stop_line_sse2(__m128i x)
+{
+    return _mm_movemask_epi8(_mm_or_si128(
+        _mm_cmpeq_epi8(x, _mm_set1_epi8('\n')),
+        _mm_cmpeq_epi8(x, _mm_setzero_si128())));
+}
+
+static inline unsigned stop_quote_sse2(__m128i x)
+{
+    return _mm_movemask_epi8(_mm_or_si128(
+        _mm_cmpeq_epi8(x, _mm_set1_epi8('"')),
+        _mm_cmpeq_epi8(x, _mm_setzero_si128())));
+}
+
+static inline unsigned stop_symbol_sse2(__m128i x)
+{
+    __m128i other = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(0x7f)),
+        _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('(')),
+            _mm_cmpeq_epi8(x, _mm_set1_epi8(')'))));
+    __m128i symbol = _mm_andnot_si128(other,
+        _mm_cmpgt_epi8(x, _mm_set1_epi8(' ')));
+
+    return ~_mm_movemask_epi8(symbol) & 0xffff;
+}
+
+AVX2 static inline unsigned stop_space_avx2(__m256i x)
+{
+    __m256i shifted = _mm256_sub_epi8(x, _mm256_set1_epi8('\t'));
+    __m256i space = _mm256_or_si256(
+        _mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')),
+        _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, _mm256_set1_epi8(4)),
+            shifted));
+
+    return ~(unsigned)_mm256_movemask_epi8(space);
+}
+
+AVX2 static inline unsigned stop_line_avx2(__m256i x)
+{
+    return _mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n')),
+        _mm256_cmpeq_epi8(x, _mm256_setzero_si256())));
+}
+
+AVX2 static inline unsigned stop_quote_avx2(__m256i x)
+{
+    return _mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')),
+        _mm256_cmpeq_epi8(x, _mm256_setzero_si256())));
+}
+
+AVX2 static inline unsigned stop_symbol_avx2(__m256i x)
+{
+    __m256i other = _mm256_or_si256(
+        _mm256_cmpeq_epi8(x, _mm256_set1_epi8(0x7f)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('(')),
+            _mm256_cmpeq_epi8(x, _mm256_set1_epi8(')'))));
+    __m256i symbol = _mm256_andnot_si256(other,
+        _mm256_cmpgt_epi8(x, _mm256_set1_epi8(' ')));
+
+    return ~(unsigned)_mm256_movemask_epi8(symbol);
+}
+
+#define SSE2_SCAN(NAME, STOP, END) \
+    SCAN(NAME##_sse2, , __m128i, _mm_load_si128, STOP##_sse2, END)
+#define AVX2_SCAN(NAME, STOP, END) \
+    SCAN(NAME##_avx2, AVX2, __m256i, _mm256_load_si256, STOP##_avx2, END)
+
+SSE2_SCAN(skip_space, stop_space, END_SPACE)
+SSE2_SCAN(find_line_end, stop_line, END_LINE)
+SSE2_SCAN(find_quote, stop_quote, END_QUOTE)
+SSE2_SCAN(find_delimiter, stop_symbol, END_SYMBOL)
+
+AVX2_SCAN(skip_space, stop_space, END_SPACE)
+AVX2_SCAN(find_line_end, stop_line, END_LINE)
+AVX2_SCAN(find_quote, stop_quote, END_QUOTE)
+AVX2_SCAN(find_delimiter, stop_symbol, END_SYMBOL)
+
+static const struct scanners sse2_scanners = {
+    skip_space_sse2,
+    find_line_end_sse2,
+    find_quote_sse2,
+    find_delimiter_sse2
+};
+
+static const struct scanners avx2_scanners = {
+    skip_space_avx2,
+    find_line_end_avx2,
+    find_quote_avx2,
+    find_delimiter_avx2
+};
+
+#endif /* TOKENS_SIMD */
+
+static const char *skip_digits(const char *p)
+{
+    while (CLASS(*p) & CHAR_DIGIT)
+        ++p;
+
+    return p;
+}
+
+// Numbers are digits[.digits][e[+-]digits]. Anything but whitespace or a
+// paren right after one is an error.
 
-    while (isspace(src[*pos]))
+static const char *scan_number(const char *p, int *type)
+{
+    *type = TOKEN_INT;
+    p = skip_digits(p);
+
+    if (*p == '.')
     {
-        *pos += 1;
+        *type = TOKEN_FLOAT;
+        p = skip_digits(p + 1);
     }
 
-    c = src[*pos];
+    if (*p == 'e' || *p == 'E')
+    {
+        *type = TOKEN_FLOAT;
+        p += 1;
 
-    if (!c)
-        return 0;
+        if (*p == '+' || *p == '-')
+            p += 1;
 
-    if (c == ';')
-    {
-        *pos += 1;
-        while (src[*pos] != '\n')
-        {
-            *pos += 1;
-        }
+        if (!(CLASS(*p) & CHAR_DIGIT))
+            return NULL;
 
-        goto start;
+        p = skip_digits(p);
     }
 
-    if (c == '(')
+    return CLASS(*p) & CHAR_BREAK ? p : NULL;
+}
+
+// The tokenizer is instantiated once for each set of scanners, so that
+// they can be inlined.
+
+__attribute__((always_inline))
+static inline int next_token(const char *src, int *pos, struct token *token,
+    const struct scanners *scan)
+{
+    const char *p = &src[*pos];
+
+start:
+
+    p = scan->skip_space(p);
+    token->s = p;
+
+    switch (*p)
     {
+    case '\0':
+        *pos = p - src;
+        return 0;
+
+    case ';':
+        p = scan->find_line_end(p + 1);
+        goto start;
+
+    case '(':
         token->type = TOKEN_LPAREN;
-        token->s = &src[*pos];
-        token->len = 1;
-        *pos += 1;
-    }
-    else if (c == ')')
-    {
+        p += 1;
+        break;
+
+    case ')':
         token->type = TOKEN_RPAREN;
-        token->s = &src[*pos];
-        token->len = 1;
-        *pos += 1;
-    }
-    else if (c == '.')
-    {
+        p += 1;
+        break;
+
+    case '.':
         token->type = TOKEN_PERIOD;
-        token->s = &src[*pos];
-        token->len = 1;
-        *pos += 1;
-    }
-    else if (c == '\'')
-    {
+        p += 1;
+        break;
+
+    case '\'':
         token->type = TOKEN_QUOTE;
-        token->s = &src[*pos];
-        token->len = 1;
-        *pos += 1;
-    }
-    else if (isdigit(c))
-    {
-        token->type = TOKEN_INT;
-        token->s = &src[*pos];
+        p += 1;
+        break;
 
-        while (!isspace(src[*pos]))
-        {
-            if (isdigit(src[*pos]))
-            {
-                *pos += 1;
-            }
-            else
-            {
-                c = src[*pos];
+    case '"':
+        token->type = TOKEN_STR;
+        token->s = p + 1;
+        p = scan->find_quote(p + 1);
 
-                if (c == '(' || c == ')')
-                {
-                    break;
-                }
+        // Unterminated string
+        if (!*p)
+            return -1;
 
-                return -1;
-            }
-        }
+        token->len = p - token->s;
+        *pos = p + 1 - src;
 
-        token->len = &src[*pos] - token->s;
-    }
-    else if (c == '"')
-    {
-        *pos += 1;
-        token->type = TOKEN_STR;
-        token->s = &src[*pos];
+        return 1;
 
-        while (src[*pos] != '"')
-        {
-            *pos += 1;
-        }
+    case '0' ... '9':
+        p = scan_number(p, &token->type);
 
-        token->len = &src[*pos] - token->s;
+        if (!p)
+            return -1;
 
-        *pos += 1;
-    }
-    else if (isalnum(c) || ispunct(c))
-    {
-        token->type = TOKEN_SYMBOL;
-        token->s = &src[*pos];
-        *pos += 1;
+        break;
 
-        while ((isalnum(src[*pos]) || ispunct(src[*pos])) && src[*pos] != '(' && src[*pos] != ')')
+    case '#':
+        if (p[1] == '(')
         {
-            *pos += 1;
+            token->type = TOKEN_VECTOR;
+            p += 2;
+            break;
         }
 
-        token->len = &src[*pos] - token->s;
+        // fall through
+
+    default:
+        if (END_SYMBOL(*p))
+            return -1;
+
+        token->type = TOKEN_SYMBOL;
+        p = scan->find_delimiter(p + 1);
+        break;
     }
-    else
+
+    token->len = p - token->s;
+    *pos = p - src;
+
+    return 1;
+}
+
+static int next_token_scalar(const char *src, int *pos,
+    struct token *token)
+{
+    return next_token(src, pos, token, &scalar_scanners);
+}
+
+#if TOKENS_SIMD
+
+static int next_token_sse2(const char *src, int *pos, struct token *token)
+{
+    return next_token(src, pos, token, &sse2_scanners);
+}
+
+AVX2 static int next_token_avx2(const char *src, int *pos,
+    struct token *token)
+{
+    return next_token(src, pos, token, &avx2_scanners);
+}
+
+#endif /* TOKENS_SIMD */
+
+static int (*tokenizer)(const char *src, int *pos, struct token *token) =
+    next_token_scalar;
+
+int tokens_use_simd(int enable)
+{
+    tokenizer = next_token_scalar;
+
+#if TOKENS_SIMD
+    if (enable)
     {
-        return -1;
+        __builtin_cpu_init();
+        tokenizer = __builtin_cpu_supports("avx2") ? next_token_avx2 :
+            next_token_sse2;
     }
+#else
+    (void) enable;
+#endif
 
-    return 1;
+    return tokenizer != next_token_scalar;
+}
+
+__attribute__((constructor))
+static void setup_tokenizer()
+{
+    tokens_use_simd(1);
+}
+
+int get_next_token(const char *src, int *pos, struct token *token)
+{
+    return tokenizer(src, pos, token);
 }
 
 #ifdef BUILD_TEST
@@ -185,4 +468,115 @@ TEST(test_get_next_token)
     ASSERT_STREQ_N("*", token.s, 1);
 }
 
+TEST(number_tokens)
+{
+    static const char *floats[] = { "1.5", "1e9", "2.5E-3", "3.", "4e+2" };
+    static const char *invalid[] = { "1.2.3", "1e", "1e+", "12a" };
+    struct token token;
+    unsigned i;
+    int pos;
+
+    for (i = 0; i < sizeof(floats) / sizeof(floats[0]); ++i)
+    {
+        pos = 0;
+        ASSERT_EQ(1, get_next_token(floats[i], &pos, &token));
+        ASSERT_EQ(TOKEN_FLOAT, token.type);
+        ASSERT_EQ((int)strlen(floats[i]), token.len);
+    }
+
+    for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i)
+    {
+        pos = 0;
+        ASSERT_EQ(-1, get_next_token(invalid[i], &pos, &token));
+    }
+
+    pos = 0;
+    ASSERT_EQ(1, get_next_token("42)", &pos, &token));
+    ASSERT_EQ(TOKEN_INT, token.type);
+    ASSERT_EQ(2, token.len);
+}
+
+TEST(unterminated_input)
+{
+    struct token token;
+    int pos = 0;
+
+    ASSERT_EQ(1, get_next_token("foo ; comment without newline", &pos,
+        &token));
+    ASSERT_EQ(0, get_next_token("foo ; comment without newline", &pos,
+        &token));
+
+    pos = 0;
+    ASSERT_EQ(-1, get_next_token("\"no closing quote", &pos, &token));
+
+    pos = 0;
+    ASSERT_EQ(1, get_next_token("\"\"", &pos, &token));
+    ASSERT_EQ(TOKEN_STR, token.type);
+    ASSERT_EQ(0, token.len);
+}
+
+// Tokenizes src and records each token as its type, start and length.
+
+static int tokenize(const char *src, int *out, int max)
+{
+    struct token token;
+    int pos = 0;
+    int n = 0;
+    int rc;
+
+    while (n + 4 <= max && (rc = get_next_token(src, &pos, &token)) > 0)
+    {
+        out[n++] = token.type;
+        out[n++] = token.s - src;
+        out[n++] = token.len;
+    }
+
+    out[n++] = rc;
+    out[n++] = pos;
+
+    return n;
+}
+
+TEST(simd_scanning_agrees_with_scalar)
+{
+    static const char alphabet[] = "  \t\n\r;\"()'#.09eE+-azAZ!?*\x7f\x80\xff";
+    int simd = tokens_use_simd(1);
+    int expected[600], actual[600];
+    char *buffer = malloc(256);
+    int round;
+
+    for (round = 0; round < 2000; ++round)
+    {
+        int offset = round % 64;
+        int len = rand() % (190 - offset);
+        char *src = buffer + offset;
+        int n, i;
+
+        // Mostly symbols and spaces, with long runs so that the scans
+        // cross several blocks.
+        for (i = 0; i < len; ++i)
+        {
+            int r = rand() % 100;
+
+            if (r < 40)
+                src[i] = 'a' + r % 26;
+            else if (r < 70)
+                src[i] = ' ';
+            else
+                src[i] = alphabet[r % (sizeof(alphabet) - 1)];
+        }
+
+        src[len] = '\0';
+
+        tokens_use_simd(0);
+        n = tokenize(src, expected, 600);
+        tokens_use_simd(1);
+        ASSERT_EQ(n, tokenize(src, actual, 600));
+        ASSERT_EQ(0, memcmp(expected, actual, n * sizeof(int)));
+    }
+
+    free(buffer);
+    tokens_use_simd(simd);
+}
+
 #endif /* BUILD_TEST */
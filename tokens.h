@@ -4,9 +4,11 @@
 enum
 {
     TOKEN_INT,
+    TOKEN_FLOAT,
     TOKEN_STR,
     TOKEN_SYMBOL,
     TOKEN_LPAREN,
+    TOKEN_VECTOR,
     TOKEN_RPAREN,
     TOKEN_PERIOD,
     TOKEN_QUOTE
@@ -21,4 +23,10 @@ struct token
 
 int get_next_token(const char *src, int *pos, struct token *token);
 
+// Whitespace, comments, strings and symbols are scanned 16 or 32 bytes
+// at a time where the CPU allows. Passing zero selects the plain byte
+// at a time code instead, for tests and benchmarks. Returns whether the
+// SIMD code is in use.
+int tokens_use_simd(int enable);
+
 #endif
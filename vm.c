@@ -0,0 +1,434 @@
+#include "vm.h"
+#include "atom.h"
+#include "eval.h"
+#include "env.h"
+#include "gc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef VM_DEFAULT_MAX_DEPTH
+#define VM_DEFAULT_MAX_DEPTH (10 * 1000 * 1000)
+#endif
+
+// The VM keeps its control stack on the heap: calls push a struct
+// vm_frame instead of recursing in C, so the depth of Lisp recursion is
+// bounded by max_depth (and memory) rather than by the C stack.
+//
+// All frames share one value stack. A frame owns the values from its
+// base upwards; the function and arguments of a call are popped by the
+// caller once the arguments have been bound in the callee's environment.
+
+struct vm_frame
+{
+    struct proto *proto;
+    struct env *env;
+    const uint16_t *ip;
+    int base;
+};
+
+static struct
+{
+    struct vm_frame *frames;
+    int frame_count;
+    int frame_capacity;
+
+    struct atom **values;
+    int sp;
+    int value_capacity;
+
+    int max_depth;
+} vm = { .max_depth = VM_DEFAULT_MAX_DEPTH };
+
+void vm_set_max_depth(int depth)
+{
+    vm.max_depth = depth;
+}
+
+int vm_get_max_depth()
+{
+    return vm.max_depth;
+}
+
+static int vm_reserve(void **array, int *capacity, int needed,
+    size_t elem_size)
+{
+    int new_capacity = *capacity ? *capacity : 64;
+    void *grown;
+
+    if (needed <= *capacity)
+        return 1;
+
+    while (new_capacity < needed)
+        new_capacity *= 2;
+
+    grown = realloc(*array, new_capacity * elem_size);
+
+    if (!grown)
+        return 0;
+
+    *array = grown;
+    *capacity = new_capacity;
+
+    return 1;
+}
+
+// Pushes a frame running proto with its values starting at the current
+// top of the value stack. Returns NULL when the stack cannot grow.
+
+static struct vm_frame *vm_push_frame(struct proto *proto, struct env *env)
+{
+    struct vm_frame *frame;
+
+    if (vm.frame_count >= vm.max_depth ||
+        !vm_reserve((void **)&vm.frames, &vm.frame_capacity,
+            vm.frame_count + 1, sizeof(*vm.frames)) ||
+        !vm_reserve((void **)&vm.values, &vm.value_capacity,
+            vm.sp + proto->max_stack + 1, sizeof(*vm.values)))
+    {
+        return NULL;
+    }
+
+    frame = &vm.frames[vm.frame_count++];
+    frame->proto = proto;
+    frame->env = env;
+    frame->ip = proto->code;
+    frame->base = vm.sp;
+
+    return frame;
+}
+
+void vm_gc_trace()
+{
+    int i;
+
+    for (i = 0; i < vm.frame_count; ++i)
+    {
+        gc_mark(vm.frames[i].proto);
+        gc_mark(vm.frames[i].env);
+    }
+
+    for (i = 0; i < vm.sp; ++i)
+        gc_mark(vm.values[i]);
+}
+
+// Returns zero, after printing an error, unless fn is a function taking
+// argc arguments. Calls are checked before their arguments are evaluated.
+
+static int vm_check_call(struct atom *fn, int argc)
+{
+    if (IS_PRIMITIVE(fn))
+        return eval_check_arity(fn->primitive, argc);
+
+    if (!IS_CLOSURE(fn))
+    {
+        printf("error: cannot evaluate\n");
+        return 0;
+    }
+
+    if (!fn->closure.proto)
+    {
+        fn->closure.proto = compile_lambda(fn->closure.params,
+            fn->closure.body);
+    }
+
+    if (argc != fn->closure.proto->param_count)
+    {
+        printf("error: incorrect number of arguments\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+// Applies fn, already checked by vm_check_call, to args. Primitives are
+// run right away. For a closure only its frame is set up: the function
+// to run and the frame are stored in *proto and *env, and NULL is
+// returned.
+
+static struct atom *vm_enter(struct atom *fn, struct atom **args, int argc,
+    struct proto **proto, struct env **env)
+{
+    if (IS_PRIMITIVE(fn))
+        return fn->primitive->fn(args, argc);
+
+    *proto = fn->closure.proto;
+    *env = env_extend_slots(fn->closure.env, (*proto)->slots,
+        (*proto)->slot_count, args, argc);
+
+    return NULL;
+}
+
+// Globals are looked up by name starting d frames up, which is where the
+// top-level environment is. Those d frames are walked on every lookup,
+// as the frames of a lambda differ from call to call. Each
+// OP_LOAD_GLOBAL has its own cache, keyed on the top-level environment,
+// so a repeated lookup skips the search by name through it and the
+// builtins until a global binding changes.
+
+static struct atom *vm_load(struct env *env, int depth, struct atom *symbol,
+    struct env_cache *cache)
+{
+    struct atom *value;
+
+    while (depth--)
+        env = env_parent(env);
+
+    if (cache)
+        value = env_lookup_cached(env, symbol, cache);
+    else
+        value = env_lookup_sym(env, symbol);
+
+    if (!value)
+    {
+        printf("error: undefined variable: %s\n", symbol->str.str);
+        return &nil_atom;
+    }
+
+    return value;
+}
+
+// vm.sp is kept up to date in memory (rather than in a local) so that a
+// collection triggered by any allocation sees exactly the live values.
+
+#define PUSH(VALUE) (vm.values[vm.sp++] = (VALUE))
+#define TOP() (vm.values[vm.sp - 1])
+
+struct atom *vm_run(struct proto *proto, struct env *env)
+{
+    int entry_depth = vm.frame_count;
+    int entry_sp = vm.sp;
+    struct vm_frame *frame = vm_push_frame(proto, env);
+    struct atom **constants;
+    const uint16_t *ip;
+
+    if (!frame)
+        goto overflow;
+
+enter:
+    proto = frame->proto;
+    env = frame->env;
+    constants = proto->constants;
+    ip = frame->ip;
+
+    for (;;)
+    {
+        switch (*ip++)
+        {
+        case OP_CONST:
+            PUSH(constants[*ip++]);
+            break;
+
+        case OP_LOAD_LOCAL:
+        {
+            struct env *scope = env;
+            struct atom *value;
+            int depth = ip[0];
+
+            while (depth--)
+                scope = env_parent(scope);
+
+            value = *env_slot(scope, ip[1]);
+
+            // A define in the body has not bound the slot yet, so look
+            // further out, like the tree-walking evaluator does.
+            if (!value)
+                value = vm_load(scope, 1, constants[ip[2]], NULL);
+
+            PUSH(value);
+            ip += 3;
+            break;
+        }
+
+        case OP_LOAD_GLOBAL:
+        {
+            struct atom *value = vm_load(env, ip[0], constants[ip[1]],
+                &proto->caches[ip[2]]);
+            PUSH(value);
+            ip += 3;
+            break;
+        }
+
+        case OP_DEFINE:
+        {
+            struct atom *symbol = constants[*ip++];
+
+            if (!env_set_sym(env, symbol, TOP()))
+            {
+                printf("error: cannot redefine %s\n", symbol->str.str);
+                TOP() = &nil_atom;
+            }
+
+            break;
+        }
+
+        case OP_DEFINE_LOCAL:
+        {
+            if (!env_define_slot(env, ip[0], TOP()))
+            {
+                printf("error: cannot redefine %s\n",
+                    constants[ip[1]]->str.str);
+                TOP() = &nil_atom;
+            }
+
+            ip += 2;
+            break;
+        }
+
+        case OP_CLOSURE:
+        {
+            struct proto *nested = proto->protos[*ip++];
+            struct atom *closure = atom_new_closure(nested->params,
+                nested->body, env);
+
+            closure->closure.proto = nested;
+            PUSH(closure);
+            break;
+        }
+
+        case OP_CHECK_CALL:
+            if (vm_check_call(TOP(), ip[0]))
+            {
+                ip += 2;
+            }
+            else
+            {
+                TOP() = &nil_atom;
+                ip = proto->code + ip[1];
+            }
+            break;
+
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        {
+            int tail = ip[-1] == OP_TAIL_CALL;
+            int argc = *ip++;
+            struct atom **args = &vm.values[vm.sp - argc];
+            struct atom *result = vm_enter(args[-1], args, argc, &proto,
+                &env);
+
+            vm.sp -= argc + 1;
+
+            if (result)
+            {
+                PUSH(result);
+
+                if (tail)
+                    goto do_return;
+
+                break;
+            }
+
+            // The callee's frame replaces this one for a tail call.
+            if (tail)
+            {
+                vm.sp = frame->base;
+                --vm.frame_count;
+            }
+            else
+            {
+                frame->ip = ip;
+            }
+
+            frame = vm_push_frame(proto, env);
+
+            if (!frame)
+                goto overflow;
+
+            goto enter;
+        }
+
+        case OP_RETURN:
+        do_return:
+        {
+            struct atom *result = TOP();
+
+            vm.sp = frame->base;
+
+            if (--vm.frame_count == entry_depth)
+                return result;
+
+            frame = &vm.frames[vm.frame_count - 1];
+            PUSH(result);
+            goto enter;
+        }
+
+        case OP_JUMP:
+            ip = proto->code + *ip;
+            break;
+
+        case OP_JUMP_UNLESS:
+            --vm.sp;
+
+            if (IS_TRUE(vm.values[vm.sp]))
+                ++ip;
+            else
+                ip = proto->code + *ip;
+            break;
+
+        case OP_ERROR:
+            printf("error: %s\n", constants[*ip++]->str.str);
+            PUSH(&nil_atom);
+            break;
+        }
+    }
+
+overflow:
+    printf("error: stack overflow\n");
+    vm.frame_count = entry_depth;
+    vm.sp = entry_sp;
+
+    return &nil_atom;
+}
+
+struct atom *vm_eval(struct atom *expr, struct env *env)
+{
+    return vm_run(compile(expr), env);
+}
+
+#ifdef BUILD_TEST
+
+#include "test_util.h"
+#include "parse.h"
+
+static struct atom *run(const char *src, struct env *env)
+{
+    int pos = 0;
+    return vm_eval(parse(src, &pos), env);
+}
+
+TEST(vm_deep_recursion_uses_heap_stack)
+{
+    struct env *env = env_new();
+    struct atom *result;
+
+    run("(define sum (lambda (n) (if (eq n 0) 0 (+ n (sum (- n 1))))))",
+        env);
+
+    result = run("(sum 200000)", env);
+    ASSERT_TRUE(IS_INT(result));
+    ASSERT_EQ(20000100000, INT_VAL(result));
+}
+
+TEST(vm_stack_overflow_is_recoverable)
+{
+    struct env *env = env_new();
+    int max_depth = vm_get_max_depth();
+    struct atom *result;
+
+    run("(define sum (lambda (n) (if (eq n 0) 0 (+ n (sum (- n 1))))))",
+        env);
+
+    vm_set_max_depth(1000);
+
+    result = run("(sum 2000)", env);
+    ASSERT_TRUE(IS_NIL(result));
+
+    result = run("(sum 100)", env);
+    ASSERT_TRUE(IS_INT(result));
+    ASSERT_EQ(5050, INT_VAL(result));
+
+    vm_set_max_depth(max_depth);
+}
+
+#endif /* BUILD_TEST */
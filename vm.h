@@ -0,0 +1,83 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stdint.h>
+
+struct atom;
+struct env;
+struct env_cache;
+
+// Instructions are a 16-bit opcode followed by its 16-bit operands. K[n],
+// F[n] and C[n] below refer to entry n of the constant table, of the
+// table of nested functions and of the inline caches of the function
+// being run.
+
+enum
+{
+    OP_CONST,           // k: push K[k]
+    OP_LOAD_LOCAL,      // d s k: push slot s of the frame d frames up,
+                        // which binds symbol K[k]
+    OP_LOAD_GLOBAL,     // d k c: look up symbol K[k] from d frames up,
+                        // using inline cache C[c]
+    OP_DEFINE,          // k: bind symbol K[k] to the top of the stack
+    OP_DEFINE_LOCAL,    // s k: bind slot s (symbol K[k]) to the top of
+                        // the stack
+    OP_CLOSURE,         // f: push a closure of nested function F[f]
+    OP_CHECK_CALL,      // n o: unless the top of the stack is a function
+                        // taking n arguments, replace it with nil and
+                        // continue at o
+    OP_CALL,            // n: call the function below the top n values
+    OP_TAIL_CALL,       // n: like OP_CALL, but return what the call returns
+    OP_JUMP,            // o: continue at instruction o
+    OP_JUMP_UNLESS,     // o: pop, continue at o unless the value was #t
+    OP_RETURN,          // return the top of the stack
+    OP_ERROR            // k: print error message K[k] and push nil
+};
+
+// A compiled function. The top-level expression given to compile is a
+// function without parameters. Functions created by OP_CLOSURE keep
+// their source so that closures stay usable by the tree-walking
+// evaluator.
+
+struct proto
+{
+    uint16_t *code;
+    int code_len;
+
+    struct atom **constants;
+    int constant_count;
+    int constant_capacity;
+
+    struct proto **protos;
+    int proto_count;
+    int proto_capacity;
+
+    struct env_cache *caches;
+    int cache_count;
+
+    int max_stack;
+    int param_count;
+
+    // The symbols bound in the frame of a call, parameters first.
+    struct atom **slots;
+    int slot_count;
+
+    struct atom *params;
+    struct atom *body;
+};
+
+struct proto *compile(struct atom *expr);
+struct proto *compile_lambda(struct atom *params, struct atom *body);
+
+struct atom *vm_run(struct proto *proto, struct env *env);
+struct atom *vm_eval(struct atom *expr, struct env *env);
+
+// Calls nested deeper than this many frames fail with a stack overflow
+// error instead of growing the VM stack further.
+void vm_set_max_depth(int depth);
+int vm_get_max_depth();
+
+void proto_gc_trace(struct proto *proto);
+void vm_gc_trace();
+
+#endif